@@ -16,7 +16,7 @@ FUSE filesystem for browsing and managing Consul resources as files. Community p
 
 %build
 cd hashifuse-master/ConsulFS
-g++ -g -o %{name} $CFLAGS -D_FILE_OFFSET_BITS=64 -std=c++11 -lfuse -ljsoncpp -lcurl main.cpp
+g++ -g -o %{name} $CFLAGS -D_FILE_OFFSET_BITS=64 -std=c++11 main.cpp ../libhashifuse/*.cpp -lfuse -ljsoncpp -lcurl -lpthread
 
 %install
 
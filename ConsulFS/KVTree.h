@@ -0,0 +1,381 @@
+/****************************************************************************
+**
+** KVTree - in-memory mirror of Consul KV metadata for ConsulFS.
+**
+** Authored by John Boero
+**
+** Holds key names, value sizes and ModifyIndex (no values) in a trie so
+** getattr/readdir can be answered without a request.  A background blocking
+** ?keys query feeds applyKeys() with names only, adding and sweeping keys.
+** The same background thread then fills in sizes and ModifyIndex: once for
+** the whole store with applyAll(), then per changed directory with
+** applyMeta().  Each directory remembers the index they were current at.
+****************************************************************************/
+
+#ifndef CONSUL_KVTREE
+#define CONSUL_KVTREE
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdint.h>
+#include <json/json.h>
+
+struct KVStat
+{
+	bool		isDir;
+	size_t		size;
+	uint64_t	modifyIndex;
+	uint64_t	flags;
+	bool		sized;		// size/modifyIndex/flags known yet.
+};
+
+class KVTree
+{
+public:
+	// Lets the FS report a size other than the value's (chunk manifests).
+	// Return -1 to use the decoded value size.
+	typedef std::function<int64_t(const Json::Value &entry)> Sizer;
+
+	KVTree() : root(new Node()), index(0), generation(0), loaded(false) {}
+
+	void setSizer(Sizer sizer)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		this->sizer = sizer;
+	}
+
+	bool isLoaded()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return loaded;
+	}
+
+	uint64_t getIndex()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return index;
+	}
+
+	// Apply a full ?keys listing taken at X-Consul-Index idx.  New keys
+	// start unsized.  Returns the number of keys that were added or removed.
+	size_t applyKeys(const Json::Value &keys, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		size_t changes = 0;
+
+		++generation;
+		for (Json::Value::const_iterator it = keys.begin(); it != keys.end(); ++it)
+		{
+			const std::string key = it->asString();
+			Node *node = walk(key, true);
+
+			// "dir/" keys only mark the directory, see walk().
+			if (key.empty() || key[key.length() - 1] == '/')
+				continue;
+
+			node->keySeen = generation;
+			if (node->isKey)
+				continue;
+
+			node->isKey = true;
+			node->sized = false;
+			++changes;
+		}
+
+		changes += sweep(root.get());
+		index = idx;
+		loaded = true;
+		return changes;
+	}
+
+	// Sizes and ModifyIndex for the whole store from one ?recurse read,
+	// current as of idx.  Names are left to applyKeys().
+	void applyAll(const Json::Value &entries, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		for (Json::Value::const_iterator it = entries.begin(); it != entries.end(); ++it)
+			setMeta(*it);
+		markAll(root.get(), idx);
+	}
+
+	// Sizes and ModifyIndex for dir's keys from a ?recurse (or per key)
+	// read of them, current as of idx.  Keys of dir the read didn't return
+	// are gone.
+	void applyMeta(const std::string &dir, const Json::Value &entries, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::set<Node*> named;
+
+		for (Json::Value::const_iterator it = entries.begin(); it != entries.end(); ++it)
+			if (Node *node = setMeta(*it))
+				named.insert(node);
+
+		Node *node = walk(dir, true);
+		for (Children::iterator it = node->children.begin(); it != node->children.end(); )
+		{
+			if (it->second->isKey && !named.count(it->second.get()))
+				it->second->isKey = false;
+
+			if (it->second->children.empty() && !it->second->isDir && !it->second->isKey)
+				node->children.erase(it++);
+			else
+				++it;
+		}
+		node->metaIndex = idx;
+	}
+
+	// Index dir's key metadata was last known current at, 0 if never.
+	uint64_t metaIndex(const std::string &dir)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(dir, false);
+		return node ? node->metaIndex : 0;
+	}
+
+	// Nothing under dir moved since its metadata was read: it's current as of idx.
+	void markMeta(const std::string &dir, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(dir, false);
+
+		if (node && idx > node->metaIndex)
+			node->metaIndex = idx;
+	}
+
+	// Keys and subdirectories directly in dir, as full paths.
+	bool keysIn(const std::string &dir, std::vector<std::string> &keys, std::vector<std::string> &dirs)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(dir, false);
+
+		if (!node)
+			return false;
+
+		const std::string prefix = dir.empty() ? dir : dir + '/';
+		for (Children::const_iterator it = node->children.begin(); it != node->children.end(); ++it)
+		{
+			if (it->second->isKey)
+				keys.push_back(prefix + it->first);
+			if (it->second->isDir || !it->second->children.empty())
+				dirs.push_back(prefix + it->first);
+		}
+		return true;
+	}
+
+	bool stat(const std::string &key, KVStat &st)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(key, false);
+
+		if (!node)
+			return false;
+
+		// Consul allows a key and a dir of the same name.  Dirs take precedence.
+		st.isDir = key.empty() || node->isDir || !node->children.empty();
+		st.size = st.isDir ? 0 : node->size;
+		st.modifyIndex = node->modifyIndex;
+		st.flags = node->flags;
+		st.sized = st.isDir || node->sized;
+		return st.isDir || node->isKey;
+	}
+
+	bool list(const std::string &dir, std::vector<std::string> &names)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(dir, false);
+
+		if (!node)
+			return false;
+
+		for (Children::const_iterator it = node->children.begin(); it != node->children.end(); ++it)
+			names.push_back(it->first);
+		return true;
+	}
+
+	// Local write-through so our own changes show before the watch catches up.
+	void set(const std::string &key, size_t size, uint64_t modifyIndex = 0, uint64_t flags = 0)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Node *node = walk(key, true);
+
+		if (key.empty() || key[key.length() - 1] == '/')
+			return;
+
+		node->isKey = true;
+		node->keySeen = generation;
+		node->size = size;
+		node->flags = flags;
+		node->sized = true;
+		if (modifyIndex)
+			node->modifyIndex = modifyIndex;
+	}
+
+	void remove(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::vector<std::string> parts = split(key);
+		Node *node = root.get();
+
+		if (parts.empty())
+			return;
+
+		for (size_t i = 0; i + 1 < parts.size(); ++i)
+		{
+			Children::iterator child = node->children.find(parts[i]);
+			if (child == node->children.end())
+				return;
+			node = child->second.get();
+		}
+
+		Children::iterator it = node->children.find(parts.back());
+		if (it == node->children.end())
+			return;
+
+		// Deleting "dir/" drops the marker; the node lives on while it has children.
+		if (key[key.length() - 1] == '/')
+			it->second->isDir = false;
+		else
+			it->second->isKey = false;
+
+		if (it->second->children.empty() && !it->second->isDir && !it->second->isKey)
+			node->children.erase(it);
+	}
+
+private:
+	struct Node;
+	typedef std::map<std::string, std::unique_ptr<Node> > Children;
+
+	struct Node
+	{
+		Children	children;
+		bool		isKey, isDir, sized;
+		size_t		size;
+		uint64_t	modifyIndex, flags;
+		uint64_t	seen, keySeen;	// Generation of the last listing that walked/named us.
+		uint64_t	metaIndex;		// As a dir: index its keys' metadata is current at.
+
+		Node() : isKey(false), isDir(false), sized(false), size(0), modifyIndex(0), flags(0), seen(0), keySeen(0), metaIndex(0) {}
+	};
+
+	static std::vector<std::string> split(const std::string &key)
+	{
+		std::vector<std::string> parts;
+		size_t start = 0, slash;
+
+		while ((slash = key.find('/', start)) != std::string::npos)
+		{
+			parts.push_back(key.substr(start, slash - start));
+			start = slash + 1;
+		}
+		if (start < key.length())
+			parts.push_back(key.substr(start));
+		return parts;
+	}
+
+	// Base64 length to raw length without decoding.
+	static size_t decodedSize(const Json::Value &value)
+	{
+		if (!value.isString())
+			return 0;
+
+		const std::string b64 = value.asString();
+		size_t len = b64.length() / 4 * 3;
+		if (b64.length() >= 1 && b64[b64.length() - 1] == '=')
+			--len;
+		if (b64.length() >= 2 && b64[b64.length() - 2] == '=')
+			--len;
+		return len;
+	}
+
+	// One ?recurse style entry.  The key's node, NULL for a "dir/" marker.
+	Node *setMeta(const Json::Value &entry)
+	{
+		const std::string key = entry["Key"].asString();
+		Node *node = walk(key, true);
+
+		if (key.empty() || key[key.length() - 1] == '/')
+			return NULL;
+
+		node->isKey = true;
+		node->keySeen = generation;
+		node->modifyIndex = entry["ModifyIndex"].asUInt64();
+		node->flags = entry["Flags"].asUInt64();
+
+		int64_t size = sizer ? sizer(entry) : -1;
+		node->size = size < 0 ? decodedSize(entry["Value"]) : size;
+		node->sized = true;
+		return node;
+	}
+
+	static void markAll(Node *node, uint64_t idx)
+	{
+		node->metaIndex = idx;
+		for (Children::iterator it = node->children.begin(); it != node->children.end(); ++it)
+			markAll(it->second.get(), idx);
+	}
+
+	// Trailing slash keys ("dir/") mark explicit directories.
+	Node *walk(const std::string &key, bool create)
+	{
+		std::vector<std::string> parts = split(key);
+		Node *node = root.get();
+
+		for (std::vector<std::string>::const_iterator it = parts.begin(); it != parts.end(); ++it)
+		{
+			Children::iterator child = node->children.find(*it);
+			if (child == node->children.end())
+			{
+				if (!create)
+					return NULL;
+				child = node->children.insert(std::make_pair(*it, std::unique_ptr<Node>(new Node()))).first;
+			}
+			node = child->second.get();
+			if (create)
+				node->seen = generation;
+		}
+
+		if (create && !key.empty() && key[key.length() - 1] == '/')
+			node->isDir = true;
+		return node;
+	}
+
+	// Drop everything the last listing didn't mention.
+	size_t sweep(Node *node)
+	{
+		size_t removed = 0;
+
+		for (Children::iterator it = node->children.begin(); it != node->children.end(); )
+		{
+			if (it->second->seen != generation)
+			{
+				++removed;
+				node->children.erase(it++);
+				continue;
+			}
+
+			// Still a dir for someone else's keys, but no longer a key itself.
+			if (it->second->isKey && it->second->keySeen != generation)
+			{
+				++removed;
+				it->second->isKey = false;
+			}
+			removed += sweep(it->second.get());
+			++it;
+		}
+		return removed;
+	}
+
+	std::mutex lock;
+	Sizer sizer;
+	std::unique_ptr<Node> root;
+	uint64_t index, generation;
+	bool loaded;
+};
+
+#endif
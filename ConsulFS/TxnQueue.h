@@ -0,0 +1,495 @@
+/****************************************************************************
+**
+** TxnQueue - batches ConsulFS KV sets/deletes into /v1/txn requests.
+**
+** Authored by John Boero
+**
+** A cp -r or rsync into /kv closes thousands of small files back to back.
+** Rather than a PUT per file, committed values are queued and a flusher
+** thread ships them as one transaction of up to maxOps operations once the
+** window passes, the batch fills, or someone fsyncs.  Queued ops stay
+** visible through stat()/lookup()/list() until Consul has them.
+**
+** Errors can't go back to close() (it has already returned), so failures are
+** remembered per key and reported by the next fsync/fsyncdir covering them,
+** the same way the kernel reports writeback errors.
+**
+** commit() is the synchronous, all-or-nothing path for callers that need the
+** result straight away (chunked objects).
+****************************************************************************/
+
+#ifndef CONSUL_TXNQUEUE
+#define CONSUL_TXNQUEUE
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <stdint.h>
+#include <errno.h>
+#include <json/json.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiUtil.h"
+#include "KVTree.h"
+
+class TxnQueue
+{
+public:
+	// Consul caps a transaction at 64 ops and txn_max_req_len (512KB) bytes.
+	static const size_t maxOps = 64;
+	static const size_t maxBytes = 384 * 1024;
+
+	// One KV operation of a transaction.
+	struct KVOp
+	{
+		std::string verb, key, value;
+		int64_t index;		// For cas, else -1.
+		uint64_t flags;
+
+		KVOp(const std::string &verb = "set", const std::string &key = "", const std::string &value = "",
+			int64_t index = -1, uint64_t flags = 0)
+			: verb(verb), key(key), value(value), index(index), flags(flags) {}
+
+		bool isDelete() const	{ return verb.compare(0, 6, "delete") == 0; }
+	};
+
+	// Called for each op Consul accepted (value NULL for deletes).
+	typedef std::function<void(const std::string &key, const std::string *value, uint64_t flags)> Listener;
+
+	TxnQueue(hashifuse::HttpEngine &engine, const std::string &url)
+		: engine(engine), url(url), running(false), urgent(false), groups(0) {}
+
+	~TxnQueue()
+	{
+		stop();
+	}
+
+	// Set before start() or the first commit().
+	void listen(Listener listener)
+	{
+		onCommit = listener;
+	}
+
+	// Start from init, after the engine.
+	void start(long windowMs)
+	{
+		window = std::chrono::milliseconds(windowMs);
+		running = true;
+		flusher = std::thread(&TxnQueue::loop, this);
+	}
+
+	// Ships whatever is still queued before returning.
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			if (!running)
+				return;
+			running = false;
+		}
+		wake.notify_all();
+		flusher.join();
+	}
+
+	// Values too big to share a transaction should go out as a plain PUT.
+	static bool fits(const std::string &value)
+	{
+		return (value.size() + 2) / 3 * 4 + 512 <= maxBytes;
+	}
+
+	// Queue a set.  cas >= 0 makes it a check-and-set against that index.
+	void set(const std::string &key, const std::string &value, int64_t cas = -1)
+	{
+		std::shared_ptr<Op> op(new Op());
+
+		op->verb = cas >= 0 ? "cas" : "set";
+		op->key = key;
+		op->value = value;
+		op->index = cas;
+		push(op);
+	}
+
+	// With tree set, key is a prefix and everything under it goes.
+	void remove(const std::string &key, bool tree = false)
+	{
+		std::shared_ptr<Op> op(new Op());
+
+		op->verb = tree ? "delete-tree" : "delete";
+		op->key = key;
+		push(op);
+	}
+
+	// Queue ops that must land in the same transaction, all or nothing:
+	// if one fails the rest of the group fails with it.
+	void group(const std::vector<KVOp> &ops)
+	{
+		std::vector<std::shared_ptr<Op> > batch;
+
+		for (size_t i = 0; i < ops.size(); ++i)
+		{
+			std::shared_ptr<Op> op(new Op());
+			static_cast<KVOp&>(*op) = ops[i];
+			op->result = op->done.get_future().share();
+			batch.push_back(op);
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			++groups;
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				batch[i]->group = groups;
+				queue.push_back(batch[i]);
+				latest[batch[i]->key] = batch[i];
+			}
+		}
+		wake.notify_all();
+	}
+
+	// Run ops now on the calling thread, in as many transactions as the
+	// limits need, stopping at the first failure.  Each transaction is
+	// applied whole or not at all.
+	int commit(const std::vector<KVOp> &ops)
+	{
+		std::vector<std::shared_ptr<Op> > batch;
+		size_t bytes = 0;
+
+		for (size_t i = 0; i <= ops.size(); ++i)
+		{
+			if (i < ops.size())
+			{
+				std::shared_ptr<Op> op(new Op());
+				static_cast<KVOp&>(*op) = ops[i];
+				op->result = op->done.get_future().share();
+				op->reported = false;
+
+				if (batch.empty() || (batch.size() < maxOps && bytes + cost(*op) <= maxBytes))
+				{
+					bytes += cost(*op);
+					batch.push_back(op);
+					continue;
+				}
+				--i;
+			}
+
+			// Report the op that failed rather than the ones it cancelled.
+			int res = 0;
+			send(batch, true);
+			for (size_t j = 0; j < batch.size(); ++j)
+			{
+				int r = batch[j]->result.get();
+				if (r && (!res || res == -ECANCELED))
+					res = r;
+			}
+			if (res)
+				return res;
+
+			batch.clear();
+			bytes = 0;
+		}
+		return 0;
+	}
+
+	bool pending(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return latest.count(key) > 0;
+	}
+
+	// 1 and the value if the last queued op on key is a set, -1 if a delete, else 0.
+	int lookup(const std::string &key, std::string *value = NULL)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		Latest::const_iterator it = latest.find(key);
+
+		if (it == latest.end())
+			return 0;
+		if (it->second->isDelete())
+			return -1;
+		if (value)
+			*value = it->second->value;
+		return 1;
+	}
+
+	// Same as lookup() but answers for directories implied by queued keys.
+	int stat(const std::string &key, KVStat &st)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		const std::string dir = key + '/';
+		Latest::const_iterator it = latest.lower_bound(dir);
+
+		st.modifyIndex = st.flags = 0;
+		st.sized = true;
+		for (; it != latest.end() && it->first.compare(0, dir.length(), dir) == 0; ++it)
+		{
+			if (!it->second->isDelete())
+			{
+				st.isDir = true;
+				st.size = 0;
+				return 1;
+			}
+		}
+
+		if ((it = latest.find(key)) == latest.end())
+			return 0;
+		if (it->second->isDelete())
+			return -1;
+
+		st.isDir = false;
+		st.size = it->second->value.size();
+		return 1;
+	}
+
+	// Fold queued children of dir ("" for the root) into a listing.
+	void list(const std::string &dir, std::set<std::string> &names)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		const std::string prefix = dir.empty() ? dir : dir + '/';
+
+		for (Latest::const_iterator it = latest.lower_bound(prefix);
+			it != latest.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it)
+		{
+			std::string name = it->first.substr(prefix.length());
+			size_t slash = name.find('/');
+
+			// A queued delete deeper down doesn't make a directory.
+			if (slash != std::string::npos)
+			{
+				if (!it->second->isDelete())
+					names.insert(name.substr(0, slash));
+			}
+			else if (it->second->isDelete())
+				names.erase(name);
+			else if (!name.empty())
+				names.insert(name);
+		}
+	}
+
+	// Flush now and wait for every op queued under prefix.  Returns the first
+	// error recorded for those keys since the last sync, and forgets it.
+	int sync(const std::string &prefix)
+	{
+		std::vector<std::shared_future<int> > waits;
+		int res = 0;
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			for (Latest::const_iterator it = latest.lower_bound(prefix);
+				it != latest.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it)
+				waits.push_back(it->second->result);
+			if (!waits.empty())
+				urgent = true;
+		}
+		wake.notify_all();
+
+		// Earlier ops on the same key are never in a later batch, so waiting
+		// on the latest op per key covers them too.
+		for (size_t i = 0; i < waits.size(); ++i)
+			waits[i].wait();
+
+		std::lock_guard<std::mutex> lk(lock);
+		for (std::map<std::string, int>::iterator it = errors.lower_bound(prefix);
+			it != errors.end() && it->first.compare(0, prefix.length(), prefix) == 0; )
+		{
+			if (!res)
+				res = it->second;
+			errors.erase(it++);
+		}
+		return res;
+	}
+
+private:
+	struct Op : KVOp
+	{
+		std::promise<int> done;
+		std::shared_future<int> result;
+		bool reported;		// Failure goes to errors for a later sync().
+		uint64_t group;		// Shared by the ops of one group(), else 0.
+
+		Op() : reported(true), group(0) {}
+	};
+	typedef std::map<std::string, std::shared_ptr<Op> > Latest;
+
+	void push(std::shared_ptr<Op> op)
+	{
+		op->result = op->done.get_future().share();
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			queue.push_back(op);
+			latest[op->key] = op;
+		}
+		wake.notify_all();
+	}
+
+	static size_t cost(const Op &op)
+	{
+		return op.key.length() + (op.value.size() + 2) / 3 * 4 + 64;
+	}
+
+	void loop()
+	{
+		std::unique_lock<std::mutex> lk(lock);
+
+		while (running || !queue.empty())
+		{
+			if (queue.empty())
+			{
+				urgent = false;
+				wake.wait(lk);
+				continue;
+			}
+
+			// Give the batch until the window passes to fill up.
+			if (running && !urgent && queue.size() < maxOps)
+			{
+				std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + window;
+				wake.wait_until(lk, deadline, [this] { return !running || urgent || queue.size() >= maxOps; });
+			}
+
+			std::vector<std::shared_ptr<Op> > batch;
+			size_t bytes = 0;
+			while (!queue.empty() && batch.size() < maxOps)
+			{
+				// A group goes whole or waits for the next batch.
+				size_t n = 1, more = cost(*queue.front());
+				while (queue.front()->group && n < queue.size() && queue[n]->group == queue.front()->group)
+					more += cost(*queue[n++]);
+				if (!batch.empty() && (batch.size() + n > maxOps || bytes + more > maxBytes))
+					break;
+
+				bytes += more;
+				batch.insert(batch.end(), queue.begin(), queue.begin() + n);
+				queue.erase(queue.begin(), queue.begin() + n);
+			}
+
+			lk.unlock();
+			send(batch, false);
+			lk.lock();
+		}
+	}
+
+	// One transaction, retried without the ops Consul named as failing unless
+	// atomic.  Any failing op rolls back the whole txn, so the rest never applied.
+	void send(std::vector<std::shared_ptr<Op> > ops, bool atomic)
+	{
+		Json::StreamWriterBuilder jsonWriter;
+		Json::CharReaderBuilder jsonReader;
+
+		jsonWriter["indentation"] = "";
+		while (!ops.empty())
+		{
+			Json::Value txn(Json::arrayValue), reply;
+			hashifuse::HttpResponse res;
+
+			for (size_t i = 0; i < ops.size(); ++i)
+			{
+				Json::Value kv;
+				kv["Verb"] = ops[i]->verb;
+				kv["Key"] = ops[i]->key;
+				if (!ops[i]->isDelete())
+					kv["Value"] = hashifuse::base64Encode(ops[i]->value);
+				if (ops[i]->index >= 0)
+					kv["Index"] = (Json::UInt64) ops[i]->index;
+				if (ops[i]->flags)
+					kv["Flags"] = (Json::UInt64) ops[i]->flags;
+				txn[(Json::ArrayIndex) i]["KV"] = kv;
+			}
+
+			int code = engine.perform(hashifuse::HttpRequest(url, "PUT", Json::writeString(jsonWriter, txn)), res);
+			if (!code)
+			{
+				for (size_t i = 0; i < ops.size(); ++i)
+					complete(ops[i], 0);
+				return;
+			}
+
+			std::stringstream stream(res.body);
+			if (code != 409 || !Json::parseFromStream(jsonReader, stream, &reply, NULL) || !reply["Errors"].isArray())
+			{
+				*logs << "Couldn't commit txn of " << ops.size() << " ops HTTP" << res.code << " " << res.body << std::endl;
+				for (size_t i = 0; i < ops.size(); ++i)
+					complete(ops[i], -EIO);
+				return;
+			}
+
+			std::set<size_t> failed;
+			const Json::Value &errs = reply["Errors"];
+			for (Json::Value::const_iterator it = errs.begin(); it != errs.end(); ++it)
+			{
+				size_t i = (*it)["OpIndex"].asUInt();
+				if (i >= ops.size())
+					continue;
+
+				*logs << "Txn op " << ops[i]->verb << " " << ops[i]->key << " failed: " << (*it)["What"].asString() << std::endl;
+				complete(ops[i], ops[i]->verb == "cas" ? -ESTALE : -EIO);
+				failed.insert(i);
+			}
+
+			// Nothing we can attribute, so don't spin on it.
+			if (failed.empty() || atomic)
+			{
+				for (size_t i = 0; i < ops.size(); ++i)
+					if (!failed.count(i))
+						complete(ops[i], failed.empty() ? -EIO : -ECANCELED);
+				return;
+			}
+
+			// The rest of a failed op's group never applied either.
+			std::set<uint64_t> dead;
+			for (std::set<size_t>::const_iterator it = failed.begin(); it != failed.end(); ++it)
+				if (ops[*it]->group)
+					dead.insert(ops[*it]->group);
+
+			std::vector<std::shared_ptr<Op> > rest;
+			for (size_t i = 0; i < ops.size(); ++i)
+				if (failed.count(i))
+					continue;
+				else if (ops[i]->group && dead.count(ops[i]->group))
+					complete(ops[i], -ECANCELED);
+				else
+					rest.push_back(ops[i]);
+			ops.swap(rest);
+		}
+	}
+
+	void complete(std::shared_ptr<Op> op, int res)
+	{
+		if (!res && onCommit)
+			onCommit(op->key, op->isDelete() ? NULL : &op->value, op->flags);
+
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			Latest::iterator it = latest.find(op->key);
+			if (it != latest.end() && it->second == op)
+				latest.erase(it);
+			if (res && op->reported)
+				errors[op->key] = res;
+		}
+		op->done.set_value(res);
+	}
+
+	hashifuse::HttpEngine &engine;
+	std::string url;
+	std::chrono::milliseconds window;
+	Listener onCommit;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread flusher;
+	bool running, urgent;
+	uint64_t groups;
+	std::deque<std::shared_ptr<Op> > queue;
+	Latest latest;						// Newest queued op per key (the overlay).
+	std::map<std::string, int> errors;	// Failures not yet reported by sync().
+};
+
+#endif
@@ -3,16 +3,31 @@
 ** ConsulFS - FUSE client for Hashicorp consul secrets.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
+** Build instructions: make (links ../libhashifuse/libhashifuse.a)
 ** Usage: ./consulfs -o direct_io /path/to/mount
 **
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
+** Layout: /kv is the local datacenter and /<dc>/kv every datacenter in the catalog.
 ** Environment Variables: 
 	CONSUL_HTTP_ADDR		consul addr.  Example: "localhost:8500"
 	CONSUL_HTTP_SSL[=true]	should we add "https://" to CONSUL_HTTP_ADDR? default false
 	CONSUL_HTTP_TOKEN		token to auth via (token is only support currently)
 	CONSULFS_LOG			path to file for logging output (or cout default)
-	CONSULFS_DC				optional dc (nonstandard env variable)
+	CONSULFS_DC				optional dc served at /kv (nonstandard env variable). default agent's dc
+	CONSULFS_TREE[=true]	mirror KV key names, sizes and ModifyIndex in memory and keep them
+							fresh in the background with a blocking ?keys query, so
+							getattr/readdir cost no requests. default false
+	CONSULFS_TXN[=true]		batch commits and deletes into /v1/txn requests of up to 64 ops.
+							Errors are reported by fsync/fsyncdir. default false
+	CONSULFS_TXN_WINDOW		ms to let a txn batch fill before sending. default 50
+	CONSULFS_PREFETCH_MAX	largest ?recurse response (bytes) to prefetch when sibling keys
+							are read in a row. 0 disables. default 4194304
+	CONSULFS_CACHE_SIZE		bytes of prefetched values to keep per dc. default 67108864
+	CONSULFS_CONSISTENCY	read mode: stale, default or consistent. default "default"
+	CONSULFS_CONSISTENCY_PREFIX	per key prefix overrides.  Example: "app/=consistent,cache/=stale"
+	CONSULFS_MAX_STALE		ms a stale read may lag the leader before it is retried. default 5000
+	CONSULFS_CHUNK_SIZE		split values larger than this many bytes into hidden chunk keys
+							behind a manifest (max 262144). 0 disables. default 0
 ****************************************************************************/
 
 #define FUSE_USE_VERSION 28
@@ -23,14 +38,27 @@
 #include <string.h>
 #include <sstream>
 #include <set>
+#include <map>
+#include <vector>
 #include <iostream>
 #include <curl/curl.h>
 #include <json/json.h>
 #include <unistd.h>
 #include <fstream>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
 
 #include <fuse.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiFile.h"
+#include "../libhashifuse/HashiUtil.h"
+#include "../libhashifuse/HashiCache.h"
+#include "KVTree.h"
+#include "TxnQueue.h"
 
 const char RESET[]	= "\033[0m";
 const char RED[]	= "\033[1;31m";
@@ -45,113 +73,939 @@ using namespace std;
 // Global api version is static.
 const string apiVers = "/v1";
 
-// Will use this to store optional dc; This is deferred.
-//string dc;
-
 // Set logs to other options via CONSULFS_LOG or default to std::cout
 ostream *logs = &cout;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Shared pooled HTTP client, configured once in consul_init.
+// FUSE callbacks submit through the async engine and wait on the result.
+hashifuse::HttpClient http;
+hashifuse::HttpEngine engine(http);
+
+// Optional in-memory mirror of KV metadata (CONSULFS_TREE=true).
+// Blocking queries wait up to treeWait seconds for a change.
+bool useTree = false;
+const long treeWait = 300;
+atomic<bool> watching(false);
 
-// CURL callback
-namespace
+// Per-open state.  Writes land in data and go to Consul as a single PUT on
+// flush/release, guarded by check-and-set against the ModifyIndex read at
+// open so a concurrent writer isn't silently overwritten.
+struct ConsulHandle : hashifuse::FileHandle
 {
-    std::size_t write_callback(
-            const char* in,
-            std::size_t size,
-            std::size_t num,
-            char* out)
-    {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+	mutex	lock;
+	bool	dirty;
+	int64_t	cas;	// Index to PUT against: 0 = key must not exist, -1 = look it up.
+	string	chunks;	// Chunk prefix of the object as opened, dropped once replaced.
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
-        return size * num;
-    }
+	ConsulHandle() : dirty(false), cas(-1) {}
+};
+
+// Open writable handles by path, so getattr reports new files and pending
+// sizes before they reach Consul.
+mutex writersLock;
+map<string, ConsulHandle*> writers;
+
+// Optional /v1/txn batching of commits (CONSULFS_TXN=true).
+bool useTxn = false;
+long txnWindow = 50;
+
+// Values pulled in by ?recurse prefetch.  With the tree loaded they stay valid
+// while ModifyIndex matches, otherwise they expire after cacheTtl ms.
+size_t prefetchMax = 4 << 20;
+size_t cacheSize = 64 << 20;
+const long cacheTtl = 5000;
+
+// Reading this many different siblings in a row (each within prefetchGap)
+// triggers a prefetch of the directory.
+const int prefetchRun = 3;
+const chrono::milliseconds prefetchGap(1000);
+
+struct ReadAhead
+{
+	string last;
+	int run;
+	bool busy;
+	chrono::steady_clock::time_point at, tried;
+
+	ReadAhead() : run(0), busy(false) {}
+};
+
+// Values over chunkSize (CONSULFS_CHUNK_SIZE) are stored as a manifest at the
+// key, marked by chunkFlags, naming chunks under "dir/.name.chunks/<gen>/".
+// Manifests are always read back; writing them is opt-in.
+const uint64_t chunkFlags = 0x43465343;	// "CFSC"
+const size_t maxChunkSize = 256 << 10;	// Base64 of a chunk must fit one txn.
+size_t chunkSize = 0;
+
+// "dir/name" -> "dir/.name.chunks/"
+string chunkDir(const string &key)
+{
+	size_t slash = key.rfind('/');
+
+	if (slash == string::npos)
+		return "." + key + ".chunks/";
+	return key.substr(0, slash + 1) + "." + key.substr(slash + 1) + ".chunks/";
+}
+
+string chunkKey(const string &prefix, size_t n)
+{
+	char num[16];
+
+	snprintf(num, sizeof(num), "%04zu", n);
+	return prefix + num;
+}
+
+// Chunk dirs are ours, so readdir hides them.
+bool isChunkDir(const string &name)
+{
+	return name.length() > 8 && name[0] == '.' && name.compare(name.length() - 7, 7, ".chunks") == 0;
+}
+
+bool parseManifest(const string &manifest, Json::Value &m)
+{
+	Json::CharReaderBuilder jsonReader;
+	stringstream stream(manifest);
+
+	return Json::parseFromStream(jsonReader, stream, &m, NULL) && m.isObject() && m["prefix"].isString();
+}
+
+// Logical size of a chunked object, for the tree and getattr.
+int64_t manifestSize(const Json::Value &entry)
+{
+	Json::Value m;
+
+	if (entry["Flags"].asUInt64() != chunkFlags || !parseManifest(hashifuse::base64Decode(entry["Value"].asString()), m))
+		return -1;
+	return m["size"].asInt64();
 }
 
+// Read consistency.  Stale reads can be answered by any server, which spreads
+// load, but are retried against the leader once they lag more than maxStale ms.
+enum Consistency { STALE, DEFAULT, CONSISTENT };
+Consistency consistency = DEFAULT;
+vector<pair<string, Consistency> > consistencyRules;	// Longest prefix first.
+long maxStale = 5000;
+
+// What the last read of a key said about staleness (user.consul.* xattrs).
+struct Staleness
+{
+	long lastContact;
+	bool knownLeader;
+	Consistency mode;
+};
+
+struct Datacenter;
+void txnCommitted(Datacenter &dc, const string &key, const string *value, uint64_t flags);
+
+// Everything kept per datacenter: tree, txn queue and caches never mix
+// DCs.  Remote DCs add ?dc= to every request.
+struct Datacenter
+{
+	string name, query;
+	KVTree tree;
+	thread watcher;
+	TxnQueue txn;
+	hashifuse::ContentCache cache;
+	mutex readAheadLock;
+	map<string, ReadAhead> readAhead;
+	mutex stalenessLock;
+	map<string, Staleness> staleness;	// By key, "" for the tree.
+
+	Datacenter(const string &name, bool remote)
+		: name(name), query(remote ? "dc=" + name : ""), txn(engine, url("/txn"))
+	{
+		cache.configure(cacheSize, cacheTtl);
+		tree.setSizer(manifestSize);
+		txn.listen([this](const string &key, const string *value, uint64_t flags) { txnCommitted(*this, key, value, flags); });
+	}
+
+	// API url of path ("/kv/...") in this DC.
+	string url(const string &path) const
+	{
+		if (query.empty())
+			return apiVers + path;
+		return apiVers + path + (path.find('?') == string::npos ? '?' : '&') + query;
+	}
+};
+
+// local is served at /kv (and /<name>/kv).  Others are created on first use
+// from the names the catalog reports.
+mutex dcsLock;
+map<string, unique_ptr<Datacenter> > dcs;
+set<string> dcNames;
+Datacenter *local = NULL;
+bool dcsStarted = false;
+
+// A mount path split into its datacenter and the "/kv/..." path inside it.
+// kv is empty for "/" and "/<dc>" themselves.
+struct Route
+{
+	Datacenter *dc;
+	string kv, key;
+};
+
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
-// TODO: sanitize environment variables for injection vulnerabilities.
 int	consulCURL(string url, stringstream &httpData, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
-	static const string tokenHead = "X-Consul-Token: ";
-	string https = "";
-	struct curl_slist *headers = NULL;
-	CURL* curl;
+	hashifuse::HttpResponse res;
+	int httpCode = engine.perform(hashifuse::HttpRequest(url, request, data), res);
 
-	// Note case sensitivity.  Must be "true" lower for effect, or set https in CONSUL_HTTP_ADDR.
-	if ((string)getenv("CONSUL_HTTP_SSL") == "true")
-		https = "https://";
-	
-	url = https + getenv("CONSUL_HTTP_ADDR") + url;	// + dc;
+	httpData << res.body;
+	if (httpCode)
+	{
+		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << res.code << endl;
+		return httpCode;
+	}
+
+	return 0;
+}
+
+// CURL wrapper with JSON
+int	consulCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+{
+	stringstream stream;
+	if (consulCURL(url, stream, request, post))
+		return -EINVAL;
+
+	stream >> jsonData;
+	return 0;
+}
+
+// Mode for a key: longest matching CONSULFS_CONSISTENCY_PREFIX, else the mount's.
+Consistency consistencyFor(const string &key)
+{
+	for (vector<pair<string, Consistency> >::const_iterator it = consistencyRules.begin(); it != consistencyRules.end(); ++it)
+		if (key.compare(0, it->first.length(), it->first) == 0)
+			return it->second;
+	return consistency;
+}
+
+Consistency parseConsistency(const string &mode)
+{
+	if (mode == "stale")
+		return STALE;
+	if (mode == "consistent")
+		return CONSISTENT;
+	return DEFAULT;
+}
+
+const char *consistencyName(Consistency mode)
+{
+	return mode == STALE ? "stale" : (mode == CONSISTENT ? "consistent" : "default");
+}
+
+// Add the read mode to a "/kv/..." path.
+string withMode(const string &path, Consistency mode)
+{
+	if (mode == DEFAULT)
+		return path;
+	return path + (path.find('?') == string::npos ? '?' : '&') + consistencyName(mode);
+}
+
+// A stale answer from a server without a leader, or lagging past maxStale.
+bool tooStale(const hashifuse::HttpResponse &res, Consistency mode)
+{
+	if (mode != STALE || (res.code != 200 && res.code != 404))
+		return false;
+	return res.header("X-Consul-KnownLeader") != "true"
+		|| atol(res.header("X-Consul-LastContact").c_str()) > maxStale;
+}
+
+void noteStaleness(Datacenter &dc, const string &key, const hashifuse::HttpResponse &res, Consistency mode)
+{
+	lock_guard<mutex> lk(dc.stalenessLock);
+	Staleness &st = dc.staleness[key];
+
+	st.lastContact = atol(res.header("X-Consul-LastContact").c_str());
+	st.knownLeader = res.header("X-Consul-KnownLeader") == "true";
+	st.mode = mode;
+
+	// Bounded; anything dropped is simply probed again.
+	if (dc.staleness.size() > 4096)
+	{
+		Staleness keep = st;
+		dc.staleness.clear();
+		dc.staleness[key] = keep;
+	}
+}
+
+// GET a KV path with the read mode for key.  Stale answers that are too old
+// are retried with default consistency, which the leader serves.
+int consulRead(Datacenter &dc, const string &path, const string &key, hashifuse::HttpResponse &res)
+{
+	Consistency mode = consistencyFor(key);
+	int code = engine.perform(hashifuse::HttpRequest(dc.url(withMode(path, mode))), res);
+
+	if (tooStale(res, mode))
+	{
+		#if DEBUG
+		*logs << YELLOW << "Stale read of " << path << " (" << res.header("X-Consul-LastContact") << "ms), asking the leader" << RESET << endl;
+		#endif
+		mode = DEFAULT;
+		code = engine.perform(hashifuse::HttpRequest(dc.url(path)), res);
+	}
+
+	if (res.code)
+		noteStaleness(dc, key, res, mode);
+	return code;
+}
+
+// consulRead parsed as JSON.
+int consulReadJson(Datacenter &dc, const string &path, const string &key, Json::Value &jsonData)
+{
+	hashifuse::HttpResponse res;
+	Json::CharReaderBuilder jsonReader;
+
+	if (consulRead(dc, path, key, res))
+	{
+		*logs << "Couldn't GET " << path << " in " << dc.name << " HTTP" << res.code << endl;
+		return -EINVAL;
+	}
+
+	stringstream stream(res.body);
+	return Json::parseFromStream(jsonReader, stream, &jsonData, NULL) ? 0 : -EINVAL;
+}
+
+// One blocking query over a DC's whole KV store.  Returns as soon as anything
+// changes past index (or after treeWait).  Names only: refreshMeta() then
+// reads sizes and ModifyIndex for just the directories that changed, so a
+// change doesn't pull every value in the store again.
+hashifuse::HttpRequest treeRequest(const Datacenter &dc, uint64_t index, Consistency mode)
+{
+	hashifuse::HttpRequest req(dc.url(withMode("/kv/?keys&index=" + to_string(index) + "&wait=" + to_string(treeWait) + "s", mode)));
+
+	req.timeout = treeWait + treeWait / 16 + 5;
+	return req;
+}
+
+// Fold a treeRequest response into the DC's tree.
+int applyTree(Datacenter &dc, const hashifuse::HttpResponse &res, uint64_t &index)
+{
+	Json::CharReaderBuilder jsonReader;
+	Json::Value keys(Json::arrayValue);
+	int code = res.ok() ? 0 : (res.code ? (int) res.code : -1);
+	uint64_t next;
+
+	// 404 is just an empty KV store.
+	if (code && code != 404)
+		return code;
+
+	next = strtoull(res.header("X-Consul-Index").c_str(), NULL, 10);
+
+	// Index going backwards (snapshot restore, etc.) means start over.
+	if (next < index)
+	{
+		index = 0;
+		return 0;
+	}
+	if (next == index && dc.tree.isLoaded())
+		return 0;
+
+	stringstream stream(res.body);
+	if (!code && !Json::parseFromStream(jsonReader, stream, &keys, NULL))
+		return -EINVAL;
 
 	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
+	size_t changes = dc.tree.applyKeys(keys, next);
+	*logs << CYAN << "KV tree " << dc.name << " at index " << next << ", " << changes << " changes" << RESET << endl;
+	#else
+	dc.tree.applyKeys(keys, next);
 	#endif
+	index = next;
+	return 0;
+}
+
+int loadTree(Datacenter &dc, uint64_t &index)
+{
+	hashifuse::HttpResponse res;
+	Consistency mode = consistencyFor("");
+
+	engine.perform(treeRequest(dc, index, mode), res);
+	if (tooStale(res, mode))
+		engine.perform(treeRequest(dc, index, mode = DEFAULT), res);
+
+	if (res.code)
+		noteStaleness(dc, "", res, mode);
+	return applyTree(dc, res, index);
+}
+
+// Sizes and ModifyIndex of the whole store in one ?recurse, the first time
+// the watcher runs.
+int loadAllMeta(Datacenter &dc)
+{
+	Json::CharReaderBuilder jsonReader;
+	Json::Value entries(Json::arrayValue);
+	hashifuse::HttpResponse res;
+	int code;
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock on line 1...
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case.
-	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(curl = curl_easy_init()))
-			return -1;
-		
-		// Beware error handling (lack).
-		headers = curl_slist_append(headers, (tokenHead + getenv("CONSUL_HTTP_TOKEN")).c_str());
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str());
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1);
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
-
-		if (data != "")
+	if ((code = consulRead(dc, "/kv/?recurse", "", res)) && code != 404)
+		return code;
+
+	stringstream stream(res.body);
+	if (!code && !Json::parseFromStream(jsonReader, stream, &entries, NULL))
+		return -EINVAL;
+
+	dc.tree.applyAll(entries, strtoull(res.header("X-Consul-Index").c_str(), NULL, 10));
+	return 0;
+}
+
+// Bring the sizes and ModifyIndex below dir up to current.  Only the watcher
+// calls this, after each change, so FUSE callbacks never wait on it.
+// A ?keys&separator=/ on a prefix comes back with the X-Consul-Index of
+// everything under it, so an unchanged subtree costs one small request and
+// is skipped whole.  A changed directory's own keys are read with ?recurse
+// when it has no subdirectories, else singly (concurrently) so deeper
+// values aren't pulled along, and its subdirectories are checked in turn.
+void refreshMeta(Datacenter &dc, const string &dir, uint64_t current)
+{
+	const uint64_t known = dc.tree.metaIndex(dir);
+	const string prefix = dir.empty() ? dir : dir + '/';
+	Json::CharReaderBuilder jsonReader;
+	Json::Value entries(Json::arrayValue);
+	hashifuse::HttpResponse res;
+	vector<string> keys, dirs;
+	int code;
+
+	if (known >= current || !dc.tree.keysIn(dir, keys, dirs))
+		return;
+
+	// The root's index is the store's, which has just moved.
+	if (known && !dir.empty() && !consulRead(dc, "/kv/" + prefix + "?keys&separator=/", prefix, res)
+		&& strtoull(res.header("X-Consul-Index").c_str(), NULL, 10) <= known)
+	{
+		dc.tree.markMeta(dir, current);
+		return;
+	}
+
+	if (dirs.empty())
+	{
+		// 404 is a directory emptied since the last listing.
+		if ((code = consulRead(dc, "/kv/" + prefix + "?recurse", prefix, res)) && code != 404)
+			return;
+
+		stringstream stream(res.body);
+		if (!code && !Json::parseFromStream(jsonReader, stream, &entries, NULL))
+			return;
+	}
+	else if (!keys.empty())
+	{
+		Consistency mode = consistencyFor(prefix);
+		vector<hashifuse::HttpRequest> requests;
+
+		for (size_t i = 0; i < keys.size(); ++i)
+			requests.push_back(hashifuse::HttpRequest(dc.url(withMode("/kv/" + keys[i], mode))));
+		vector<hashifuse::HttpResponse> responses = engine.performAll(requests);
+
+		for (size_t i = 0; i < responses.size(); ++i)
+		{
+			Json::Value one;
+			stringstream stream(responses[i].body);
+
+			if (responses[i].code == 404)
+				continue;
+			if (!responses[i].ok() || !Json::parseFromStream(jsonReader, stream, &one, NULL) || !one.isArray())
+				return;
+			entries.append(one[0]);
+		}
+	}
+
+	dc.tree.applyMeta(dir, entries, current);
+	for (size_t i = 0; i < dirs.size() && watching; ++i)
+		refreshMeta(dc, dirs[i], current);
+}
+
+// Background long-poll keeping one DC's tree fresh.  Names first, then the
+// metadata of whatever they say changed.
+void watchTree(Datacenter *dc, uint64_t index)
+{
+	while (watching)
+	{
+		if (dc->tree.isLoaded())
 		{
-			#if DEBUG
-			*logs << YELLOW << data << RESET << endl;
-			#endif 
-			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
+			if (!dc->tree.metaIndex("") && loadAllMeta(*dc))
+				*logs << RED << "Unable to load KV sizes for " << dc->name << ", reading them per directory" << RESET << endl;
+			refreshMeta(*dc, "", dc->tree.getIndex());
 		}
-		
-		curl_easy_perform(curl);
 
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
+		if (loadTree(*dc, index) && watching)
+		{
+			*logs << RED << "KV tree watch failed for " << dc->name << ", retrying" << RESET << endl;
+			this_thread::sleep_for(chrono::seconds(1));
+		}
 	}
-	if (httpCode < 200 || httpCode >= 300)
+}
+
+// Map "/kv/some/key" to "some/key".
+string kvKey(const string &path)
+{
+	return path.length() > 4 ? path.substr(4) : "";
+}
+
+// Keep the tree in step with what the txn flusher committed.
+void txnCommitted(Datacenter &dc, const string &key, const string *value, uint64_t flags)
+{
+	dc.cache.erase(key);
+	if (!useTree)
+		return;
+
+	if (!value)
 	{
-		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
-		return httpCode;
+		dc.tree.remove(key);
+		return;
 	}
 
+	Json::Value m;
+	if (flags == chunkFlags && parseManifest(*value, m))
+		dc.tree.set(key, m["size"].asUInt64(), 0, flags);
+	else
+		dc.tree.set(key, value->size(), 0, flags);
+}
+
+// Start a DC's txn flusher and tree watcher.  Caller holds dcsLock.
+void startDC(Datacenter *dc, uint64_t index)
+{
+	if (useTxn)
+		dc->txn.start(txnWindow);
+	if (useTree)
+		dc->watcher = thread(watchTree, dc, index);
+}
+
+// Find (or create) a DC by name.  Unknown names are refused so stray lookups
+// (.Trash, autorun.inf) don't turn into requests.
+Datacenter *getDC(const string &name)
+{
+	lock_guard<mutex> lk(dcsLock);
+	map<string, unique_ptr<Datacenter> >::iterator it = dcs.find(name);
+
+	if (it != dcs.end())
+		return it->second.get();
+	if (!dcNames.count(name))
+		return NULL;
+
+	Datacenter *dc = new Datacenter(name, true);
+	dcs[name].reset(dc);
+	if (dcsStarted)
+		startDC(dc, 0);
+	return dc;
+}
+
+// Refresh the datacenter names from the catalog.
+int refreshDCs()
+{
+	Json::Value names;
+
+	if (consulCURLjson(apiVers + "/catalog/datacenters", names))
+		return -EIO;
+
+	lock_guard<mutex> lk(dcsLock);
+	for (Json::Value::const_iterator it = names.begin(); it != names.end(); ++it)
+		dcNames.insert(it->asString());
 	return 0;
 }
 
-// CURL wrapper with JSON
-int	consulCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+// "/kv/..." is the local DC, "/<dc>/kv/..." any other.
+bool route(const string &path, Route &r)
 {
+	size_t slash = path.find('/', 1);
+	const string first = path.substr(1, slash == string::npos ? string::npos : slash - 1);
+
+	r.dc = NULL;
+	r.kv = r.key = "";
+	if (path == "/")
+		return true;
+
+	if (first == "kv")
+	{
+		r.dc = local;
+		r.kv = path;
+	}
+	else
+	{
+		if (!(r.dc = getDC(first)))
+			return false;
+		if (slash != string::npos)
+			r.kv = path.substr(slash);
+		if (!r.kv.empty() && r.kv != "/kv" && r.kv.compare(0, 4, "/kv/") != 0)
+			return false;
+	}
+
+	r.key = kvKey(r.kv);
+	return true;
+}
+
+// Value and ModifyIndex of one key.  The JSON form is used over ?raw since
+// the base64 Value is binary safe and the index is needed for cas.
+int consulFetch(const Route &r, string &value, int64_t &index, uint64_t *flags = NULL)
+{
+	hashifuse::HttpResponse res;
+	Json::CharReaderBuilder jsonReader;
+	Json::Value entries;
+	int code = consulRead(*r.dc, r.kv, r.key, res);
+
+	if (code == 404)
+		return -ENOENT;
+	if (code)
+	{
+		*logs << "Couldn't GET " << r.kv << " in " << r.dc->name << " HTTP" << res.code << endl;
+		return -EIO;
+	}
+
+	stringstream stream(res.body);
+	if (!Json::parseFromStream(jsonReader, stream, &entries, NULL) || !entries.isArray() || entries.empty())
+		return -EIO;
+
+	value = hashifuse::base64Decode(entries[0]["Value"].asString());
+	index = entries[0]["ModifyIndex"].asInt64();
+	if (flags)
+		*flags = entries[0]["Flags"].asUInt64();
+	return 0;
+}
+
+// Fetch every chunk a manifest names concurrently and reassemble them.
+// -EAGAIN if a chunk is gone, i.e. the object was rewritten meanwhile.
+int loadChunks(const Route &r, const Json::Value &m, string &data)
+{
+	vector<hashifuse::HttpRequest> requests;
+	Consistency mode = consistencyFor(r.key);
+	const string prefix = m["prefix"].asString();
+	const size_t count = m["chunks"].asUInt64();
+
+	for (size_t i = 0; i < count; ++i)
+		requests.push_back(hashifuse::HttpRequest(r.dc->url(withMode("/kv/" + chunkKey(prefix, i) + "?raw", mode))));
+
+	vector<hashifuse::HttpResponse> responses = engine.performAll(requests);
+
+	data.clear();
+	data.reserve(m["size"].asUInt64());
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!responses[i].ok())
+			return responses[i].code == 404 ? -EAGAIN : -EIO;
+		data += responses[i].body;
+	}
+
+	return data.size() == m["size"].asUInt64() ? 0 : -EIO;
+}
+
+// PUT a whole value, with ?cas when cas >= 0.  Consul answers "true" or "false".
+int consulPut(const Route &r, const string &value, int64_t cas = -1)
+{
+	Datacenter &dc = *r.dc;
 	stringstream stream;
-	if (consulCURL(url, stream, request, post))
+	string url = r.kv;
+
+	// Queue it when batching, errors surface at fsync/fsyncdir.
+	if (useTxn)
+	{
+		if (TxnQueue::fits(value))
+		{
+			dc.txn.set(r.key, value, cas);
+			dc.cache.erase(r.key);
+			return 0;
+		}
+
+		// Too big to batch.  Let anything queued on this key land first.
+		dc.txn.sync(r.key);
+	}
+
+	if (cas >= 0)
+		url += "?cas=" + to_string(cas);
+
+	if (consulCURL(dc.url(url), stream, "PUT", value))
 		return -EINVAL;
 
-	stream >> jsonData;
+	if (stream.str().compare(0, 4, "true") != 0)
+	{
+		*logs << RED << "Check-and-set failed for " << r.kv << " at index " << cas << RESET << endl;
+		return -ESTALE;
+	}
+
+	if (useTree)
+		dc.tree.set(r.key, value.size());
+	dc.cache.erase(r.key);
 	return 0;
 }
 
+// Fetch a key for open, reassembling chunked objects (only the manifest
+// when the content isn't wanted).  A rewrite can drop the chunks between
+// reading the manifest and them, so that is retried once.
+int fetchObject(const Route &r, ConsulHandle *h, bool content)
+{
+	uint64_t flags = 0;
+	Json::Value m;
+	int res;
+
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		if ((res = consulFetch(r, h->data, h->cas, &flags)) || flags != chunkFlags)
+			return res;
+		if (!parseManifest(h->data, m))
+			return -EIO;
+
+		h->chunks = m["prefix"].asString();
+		if (!content)
+		{
+			h->data.clear();
+			return 0;
+		}
+		if ((res = loadChunks(r, m, h->data)) != -EAGAIN)
+			return res;
+	}
+	return -EIO;
+}
+
+// Write a big value as chunks plus a manifest.  The chunks go to a fresh
+// generation first (Consul caps a txn at 512KB, so usually several txns),
+// then one cas txn swaps the manifest in and drops the old generation.
+// Readers see the old object or the new one, never a mix.
+int consulPutChunked(const Route &r, const string &data, int64_t cas, string &chunks)
+{
+	Datacenter &dc = *r.dc;
+	vector<TxnQueue::KVOp> ops;
+	const string prefix = chunkDir(r.key) + to_string(chrono::system_clock::now().time_since_epoch().count()) + "/";
+	const size_t count = (data.size() + chunkSize - 1) / chunkSize;
+	Json::StreamWriterBuilder jsonWriter;
+	Json::Value manifest;
+	int res;
+
+	// Anything queued on this key lands first.
+	if (useTxn)
+		dc.txn.sync(r.key);
+
+	for (size_t i = 0; i < count; ++i)
+		ops.push_back(TxnQueue::KVOp("set", chunkKey(prefix, i), data.substr(i * chunkSize, chunkSize)));
+
+	if (!(res = dc.txn.commit(ops)))
+	{
+		manifest["size"] = (Json::UInt64) data.size();
+		manifest["chunkSize"] = (Json::UInt64) chunkSize;
+		manifest["chunks"] = (Json::UInt64) count;
+		manifest["prefix"] = prefix;
+		jsonWriter["indentation"] = "";
+
+		ops.clear();
+		ops.push_back(TxnQueue::KVOp(cas >= 0 ? "cas" : "set", r.key, Json::writeString(jsonWriter, manifest), cas, chunkFlags));
+		if (!chunks.empty())
+			ops.push_back(TxnQueue::KVOp("delete-tree", chunks));
+		res = dc.txn.commit(ops);
+	}
+
+	if (res)
+	{
+		*logs << RED << "Couldn't write " << count << " chunks for " << r.kv << RESET << endl;
+		dc.txn.commit(vector<TxnQueue::KVOp>(1, TxnQueue::KVOp("delete-tree", prefix)));
+		return res;
+	}
+
+	chunks = prefix;
+	return 0;
+}
+
+// Drop a chunk generation (or every generation, given chunkDir).
+void dropChunks(Datacenter &dc, const string &prefix)
+{
+	stringstream stream;
+
+	if (useTxn)
+		dc.txn.remove(prefix, true);
+	else
+		consulCURL(dc.url("/kv/" + prefix + "?recurse"), stream, "DELETE");
+}
+
+// Ops that must land together: one queued group when batching, otherwise
+// a txn straight away.
+int commitTogether(Datacenter &dc, const vector<TxnQueue::KVOp> &ops)
+{
+	if (!useTxn)
+		return dc.txn.commit(ops);
+
+	dc.txn.group(ops);
+	for (size_t i = 0; i < ops.size(); ++i)
+		dc.cache.erase(ops[i].key);
+	return 0;
+}
+
+// Push a handle's buffered writes, if any.
+int consulCommit(const Route &r, ConsulHandle *h)
+{
+	lock_guard<mutex> lk(h->lock);
+	int res;
+
+	if (!h->dirty)
+		return 0;
+
+	// Committed once already (or never read), so take the current index.
+	// While an earlier commit is still queued Consul's index is behind ours,
+	// so fall back to a plain set ordered after it.
+	if (h->cas < 0 && !(useTxn && r.dc->txn.pending(r.key)))
+	{
+		string current;
+		if ((res = consulFetch(r, current, h->cas)) == -ENOENT)
+			h->cas = 0;
+		else if (res)
+			return res;
+	}
+
+	if (chunkSize && h->data.size() > chunkSize)
+	{
+		if ((res = consulPutChunked(r, h->data, h->cas, h->chunks)))
+			return res;
+	}
+	else if (!h->chunks.empty() && TxnQueue::fits(h->data))
+	{
+		// Was chunked, now small enough to be a plain value.  It shares a
+		// txn with dropping the old chunks, so a failed cas keeps both.
+		vector<TxnQueue::KVOp> ops;
+
+		ops.push_back(TxnQueue::KVOp(h->cas >= 0 ? "cas" : "set", r.key, h->data, h->cas));
+		ops.push_back(TxnQueue::KVOp("delete-tree", h->chunks));
+		if ((res = commitTogether(*r.dc, ops)))
+			return res;
+		h->chunks.clear();
+	}
+	else
+	{
+		// Too big for a txn, so consulPut waits for the PUT itself and the
+		// old chunks only go once it has landed.
+		if ((res = consulPut(r, h->data, h->cas)))
+			return res;
+		if (!h->chunks.empty())
+		{
+			dropChunks(*r.dc, h->chunks);
+			h->chunks.clear();
+		}
+	}
+
+	h->dirty = false;
+	h->cas = -1;
+	return 0;
+}
+
+void addWriter(const string &path, ConsulHandle *h)
+{
+	lock_guard<mutex> lk(writersLock);
+	writers[path] = h;
+}
+
+void removeWriter(const string &path, ConsulHandle *h)
+{
+	lock_guard<mutex> lk(writersLock);
+	map<string, ConsulHandle*>::iterator it = writers.find(path);
+
+	if (it != writers.end() && it->second == h)
+		writers.erase(it);
+}
+
+// Serve a key from the DC's prefetch cache if it is still current.
+bool cachedValue(Datacenter &dc, const string &key, string &value, int64_t &index)
+{
+	uint64_t version;
+	KVStat st;
+
+	if (!dc.cache.get(key, value, &version))
+		return false;
+
+	if (useTree && dc.tree.isLoaded() && (!dc.tree.stat(key, st) || !st.sized || st.modifyIndex != version))
+	{
+		dc.cache.erase(key);
+		return false;
+	}
+
+	index = version;
+	return true;
+}
+
+// Pull every value under dir in one ?recurse GET.  The request is cut off
+// once the response passes prefetchMax, so huge prefixes are never pulled.
+void prefetch(Datacenter &dc, const string &dir)
+{
+	Consistency mode = consistencyFor(dir.empty() ? dir : dir + '/');
+	hashifuse::HttpRequest req(dc.url(withMode("/kv/" + (dir.empty() ? "" : dir + "/") + "?recurse", mode)));
+	hashifuse::HttpResponse res;
+	Json::CharReaderBuilder jsonReader;
+	Json::Value entries;
+
+	req.maxBody = prefetchMax;
+	if (engine.perform(req, res))
+	{
+		#if DEBUG
+		if (res.result == CURLE_WRITE_ERROR)
+			*logs << YELLOW << "Prefix " << dir << " is over CONSULFS_PREFETCH_MAX, not prefetching" << RESET << endl;
+		#endif
+		return;
+	}
+
+	// Not worth a second full transfer; the next opens just fetch singly.
+	if (tooStale(res, mode))
+		return;
+
+	stringstream stream(res.body);
+	if (!Json::parseFromStream(jsonReader, stream, &entries, NULL) || !entries.isArray())
+		return;
+
+	for (Json::Value::const_iterator it = entries.begin(); it != entries.end(); ++it)
+	{
+		const string key = (*it)["Key"].asString();
+		if (key.empty() || key[key.length() - 1] == '/')
+			continue;
+
+		// Manifests need their chunks reassembled, so leave them to open.
+		if ((*it)["Flags"].asUInt64() == chunkFlags || key.find(".chunks/") != string::npos)
+			continue;
+
+		dc.cache.put(key, hashifuse::base64Decode((*it)["Value"].asString()),
+			(*it)["ModifyIndex"].asUInt64(), useTree ? 0 : cacheTtl);
+	}
+}
+
+// Called on a cache miss.  Returns true if it prefetched key's directory.
+bool readAheadFor(Datacenter &dc, const string &key)
+{
+	size_t slash = key.rfind('/');
+	const string dir = slash == string::npos ? "" : key.substr(0, slash);
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+	if (!prefetchMax || !dc.cache.enabled())
+		return false;
+
+	{
+		lock_guard<mutex> lk(dc.readAheadLock);
+		if (dc.readAhead.size() > 4096)
+			dc.readAhead.clear();
+
+		ReadAhead &ra = dc.readAhead[dir];
+
+		// One prefetch per dir at a time, and not again until its values
+		// would have expired (or after it was found too big).
+		if (ra.busy || now - ra.tried < chrono::milliseconds(cacheTtl))
+			return false;
+
+		ra.run = ra.last != key && now - ra.at < prefetchGap ? ra.run + 1 : 1;
+		ra.last = key;
+		ra.at = now;
+		if (ra.run < prefetchRun)
+			return false;
+
+		ra.busy = true;
+		ra.run = 0;
+	}
+
+	prefetch(dc, dir);
+
+	lock_guard<mutex> lk(dc.readAheadLock);
+	dc.readAhead[dir].busy = false;
+	dc.readAhead[dir].tried = chrono::steady_clock::now();
+	return true;
+}
+
 // We need to assume quite a few attrs.
 // Use key trailing slash to identify dir/file.
 int consul_getattr(const char *path, struct stat *stat)
 {
 	string p(path), key;
 	Json::Value keys;
+	Route r;
 
 	stat->st_uid = getuid();
 	stat->st_gid = getgid();
@@ -164,19 +1018,70 @@ int consul_getattr(const char *path, struct stat *stat)
 	//stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
 	stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
 
+	if (!route(p, r))
+		return -ENOENT;
+
 	// For now we just support kv endpoint.
 	// TODO - add catalog, services, health, etc.
-	if (p == "/" || p == "/kv")
+	if (r.kv.empty() || r.kv == "/kv")
 	{
 		stat->st_mode = S_IFDIR | 0500;
 		return 0;
 	}
 
-	if (consulCURLjson(apiVers + p + "?keys&separator=/", keys))
+	Datacenter &dc = *r.dc;
+
+	// Unflushed writes win over what Consul (or the tree) has.
+	{
+		lock_guard<mutex> lk(writersLock);
+		map<string, ConsulHandle*>::iterator w = writers.find(p);
+		if (w != writers.end())
+		{
+			lock_guard<mutex> hlk(w->second->lock);
+			stat->st_mode = S_IFREG | 0600;
+			stat->st_size = w->second->data.size();
+			return 0;
+		}
+	}
+
+	// Then commits still queued for a transaction.
+	if (useTxn)
+	{
+		KVStat st;
+		switch (dc.txn.stat(r.key, st))
+		{
+		case -1:
+			// Only the key is going, a dir of the same name stays.
+			if (!(useTree && dc.tree.isLoaded() && dc.tree.stat(r.key, st) && st.isDir))
+				return -ENOENT;
+			break;
+		case 1:
+			stat->st_mode = st.isDir ? S_IFDIR | 0700 : S_IFREG | 0600;
+			stat->st_size = st.size;
+			return 0;
+		}
+	}
+
+	// Answer locally from the mirrored tree.
+	if (useTree && dc.tree.isLoaded())
+	{
+		KVStat st;
+		if (!dc.tree.stat(r.key, st))
+			return -ENOENT;
+
+		stat->st_mode = st.isDir ? S_IFDIR | 0700 : S_IFREG | 0600;
+		stat->st_size = st.size;
+
+		// ModifyIndex only ever grows per key, so rsync/make still see changes.
+		stat->st_mtime = stat->st_ctime = st.modifyIndex;
+		return 0;
+	}
+
+	if (consulReadJson(dc, r.kv + "?keys&separator=/", r.key, keys))
 		return -ENOENT;
 
 	// Chop off the "/kv/"
-	p = p.substr(4);
+	p = r.key;
 	for (Json::ValueConstIterator it = keys.begin(); it != keys.end(); ++it)
 	{
 		// Do keys start with "path" or "path/"?
@@ -196,34 +1101,120 @@ int consul_getattr(const char *path, struct stat *stat)
 	return 0;
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
-int consul_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Fetch the whole value once per open and keep it in fi->fh until release.
+// Reads (including the trailing EOF read under direct_io) are then local,
+// and writes are buffered there until flush.
+int consul_open(const char *path, struct fuse_file_info *fi)
 {
-	string data;
-	stringstream sstream;
+	ConsulHandle *h;
+	Route r;
+	int queued, res = 0;
 
-	if (consulCURL(apiVers + path + "?raw=true", sstream))
+	if (!route(path, r) || !r.dc)
 		return -ENOENT;
 
-	data = sstream.str();
-	if (data.length() - offset <= 0)
-		return 0;
+	h = new ConsulHandle();
+	queued = useTxn ? r.dc->txn.lookup(r.key, &h->data) : 0;
+
+	// A queued commit is newer than Consul.  Then try the prefetch cache
+	// (which a run of sibling reads fills).  Otherwise even write-only
+	// opens need the ModifyIndex for cas.
+	if (queued < 0)
+		res = -ENOENT;
+	else if (!queued && !cachedValue(*r.dc, r.key, h->data, h->cas)
+		&& !(readAheadFor(*r.dc, r.key) && cachedValue(*r.dc, r.key, h->data, h->cas)))
+		res = fetchObject(r, h, !(fi->flags & O_TRUNC));
+
+	if (res)
+	{
+		delete h;
+		return res;
+	}
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+	// FUSE_CAP_ATOMIC_O_TRUNC hands us O_TRUNC instead of a separate truncate.
+	if (fi->flags & O_TRUNC)
+	{
+		h->data.clear();
+		h->dirty = true;
+	}
+
+	hashifuse::setHandle(fi, h);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		addWriter(path, h);
+	return 0;
+}
+
+int consul_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+
+	if (!h)
+		return -EBADF;
+
+	lock_guard<mutex> lk(h->lock);
+	return hashifuse::readBuffer(h->data, buf, size, offset);
 }
 
-// Writes are straightforward.  Should verify size < consul maximum though the API should do that.
+// Writes only touch the handle buffer.  Should verify size < consul maximum
+// though the API will refuse it at flush anyway.
 int consul_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	stringstream stream;
-	if (consulCURL(apiVers + path, stream, "PUT", buf))
-		return -EINVAL;
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+
+	if (!h)
+		return -EBADF;
+
+	lock_guard<mutex> lk(h->lock);
+	if (offset + size > h->data.size())
+		h->data.resize(offset + size);
+
+	h->data.replace(offset, size, buf, size);
+	h->dirty = true;
 	return size;
 }
 
+// close() lands here, so a failed cas is reported to the writer.
+int consul_flush(const char *path, struct fuse_file_info *fi)
+{
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+	Route r;
+
+	if (!h || !route(path, r) || !r.dc)
+		return 0;
+	return consulCommit(r, h);
+}
+
+int consul_release(const char *path, struct fuse_file_info *fi)
+{
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+	Route r;
+	int res = 0;
+
+	if (h)
+	{
+		if (route(path, r) && r.dc)
+			res = consulCommit(r, h);
+		removeWriter(path, h);
+	}
+
+	hashifuse::freeHandle(fi);
+	return res;
+}
+
+// Push buffered writes, and with CONSULFS_TXN wait until Consul has them.
+int consul_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+	Route r;
+	int res;
+
+	if (!route(path, r) || !r.dc)
+		return 0;
+	if (h && (res = consulCommit(r, h)))
+		return res;
+	return useTxn ? r.dc->txn.sync(r.key) : 0;
+}
+
 // Return stat of root fs (partition).
 int consul_statfs(const char *path, struct statvfs *statv)
 {
@@ -247,27 +1238,46 @@ int consul_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t of
 	Json::Value keys;
 	string p(path), f;
 	set<string> names;
+	Route r;
+
+	if (!route(p, r))
+		return -ENOENT;
 
+	// Local kv, then every datacenter the catalog knows.
 	if (p == "/")
 	{
-		if (consulCURLjson(apiVers + p + "/catalog/datacenters", keys))
-			return -ENOENT;
-		
-		filler(buf, "health", NULL, 0);
+		refreshDCs();
+		filler(buf, "kv", NULL, 0);
 
+		lock_guard<mutex> lk(dcsLock);
+		for (set<string>::iterator name = dcNames.begin(); name != dcNames.end(); ++name)
+			filler(buf, name->c_str(), NULL, 0);
+		return 0;
+	}
 
+	if (r.kv.empty())
+	{
+		filler(buf, "kv", NULL, 0);
 		return 0;
 	}
 
-	// Need separator to not recurse
-	if (consulCURLjson(apiVers + p + "/?keys=true&separator=/", keys))
+	Datacenter &dc = *r.dc;
+
+	if (useTree && dc.tree.isLoaded())
+	{
+		vector<string> children;
+		if (!dc.tree.list(r.key, children) && !useTxn)
+			return -ENOENT;
+
+		names.insert(children.begin(), children.end());
+	}
+	// Need separator to not recurse.  A dir may exist only in the txn queue so far.
+	else if (consulReadJson(dc, r.kv + "/?keys=true&separator=/", r.key, keys) && !useTxn)
 		return -ENOENT;
 
 	// Chop off "/kv/" or "/kv" (annoyingly we need both).
-	p = p.substr(3);
-	if (p.length() > 0 && p[0] == '/')
-		p = p.substr(1);
-	
+	p = r.key;
+
 	// Use a set to eliminate duplicates.
 	// Ugly but unfortunately Consul API keys=true implies recursive.
 	for(Json::Value::const_iterator itr = keys.begin() ; itr != keys.end() ; itr++ )
@@ -284,36 +1294,222 @@ int consul_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t of
 			names.insert(f);
 	}
 
+	if (useTxn)
+		dc.txn.list(r.key, names);
+
 	// Unwind the unique set..
 	for (set<string>::iterator name = names.begin(); name != names.end(); ++name)
-    	filler(buf, name->c_str(), NULL, 0);
+		if (!isChunkDir(*name))
+    		filler(buf, name->c_str(), NULL, 0);
 	return 0;
 }
 
-// Need to implement this for truncate/write even though we do nothing.
+// Resize an open writer's buffer if there is one, else read-modify-write.
 int consul_truncate(const char *path, off_t newsize)
 {
+	Route r;
+	int res;
+
+	if (!route(path, r) || !r.dc)
+		return -ENOENT;
+
+	{
+		lock_guard<mutex> lk(writersLock);
+		map<string, ConsulHandle*>::iterator w = writers.find(path);
+		if (w != writers.end())
+		{
+			lock_guard<mutex> hlk(w->second->lock);
+			w->second->data.resize(newsize);
+			w->second->dirty = true;
+			return 0;
+		}
+	}
+
+	// Through a handle so chunked objects are rewritten properly.
+	ConsulHandle h;
+	if ((res = fetchObject(r, &h, newsize != 0)))
+		return res;
+	if (h.chunks.empty() && h.data.size() == (size_t) newsize)
+		return 0;
+
+	h.data.resize(newsize);
+	h.dirty = true;
+	return consulCommit(r, &h);
+}
+
+int consul_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+	ConsulHandle *h = static_cast<ConsulHandle*>(hashifuse::getHandle(fi));
+
+	if (!h)
+		return consul_truncate(path, newsize);
+
+	lock_guard<mutex> lk(h->lock);
+	h->data.resize(newsize);
+	h->dirty = true;
 	return 0;
 }
 
 // Write a blank key
 int consul_mkdir(const char *path, mode_t mode)
 {
-	return consul_write(((string)path + '/').c_str(), "", 0, 0, NULL);
+	Route r;
+
+	if (!route((string)path + '/', r) || r.kv.empty())
+		return -EPERM;
+	return consulPut(r, "");
 }
 
-// Write a blank key.
+// Nothing is written until flush.  cas=0 fails if someone else creates the key first.
 int consul_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	return consul_write(path, "", 0, 0, fi);
+	ConsulHandle *h;
+	Route r;
+
+	if (!route(path, r) || r.kv.empty() || r.kv == "/kv")
+		return -EPERM;
+
+	h = new ConsulHandle();
+	h->cas = 0;
+	h->dirty = true;
+	hashifuse::setHandle(fi, h);
+	addWriter(path, h);
+	return 0;
+}
+
+// user.consul.staleness (ms behind the leader), .knownleader and .consistency,
+// as of the read that produced what we're showing for this path, and
+// user.consul.modifyindex of the key itself.
+const char consulXattrs[] = "user.consul.staleness\0user.consul.knownleader\0user.consul.consistency\0user.consul.modifyindex";
+
+// From the tree when it's mirrored (also mtime then), else a GET of the key.
+int modifyIndexOf(const Route &r, int64_t &index)
+{
+	KVStat st;
+	string value;
+
+	if (!useTree || !r.dc->tree.isLoaded())
+		return consulFetch(r, value, index);
+
+	if (!r.dc->tree.stat(r.key, st))
+		return -ENOENT;
+	index = st.modifyIndex;
+	return 0;
+}
+
+int xattrValue(const string &out, char *value, size_t size)
+{
+	if (!size)
+		return out.size();
+	if (size < out.size())
+		return -ERANGE;
+
+	memcpy(value, out.data(), out.size());
+	return out.size();
+}
+
+int consul_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	string attr(name), out;
+	Staleness st;
+	bool found = false;
+	int64_t index;
+	Route r;
+
+	if (!route(path, r) || r.kv.empty())
+		return -ENODATA;
+	if (attr == "user.consul.modifyindex")
+		return modifyIndexOf(r, index) ? -ENODATA : xattrValue(to_string(index), value, size);
+	if (attr != "user.consul.staleness" && attr != "user.consul.knownleader" && attr != "user.consul.consistency")
+		return -ENODATA;
+
+	// Keys served from the tree are as fresh as its last query.
+	{
+		lock_guard<mutex> lk(r.dc->stalenessLock);
+		map<string, Staleness>::iterator it = r.dc->staleness.find(r.key);
+		if (it == r.dc->staleness.end() && useTree && r.dc->tree.isLoaded())
+			it = r.dc->staleness.find("");
+		if ((found = it != r.dc->staleness.end()))
+			st = it->second;
+	}
+
+	// Never read yet, so ask with the mode it would be read with.
+	if (!found)
+	{
+		hashifuse::HttpResponse res;
+		consulRead(*r.dc, r.kv + "?keys&separator=/", r.key, res);
+		if (!res.code)
+			return -EIO;
+
+		lock_guard<mutex> lk(r.dc->stalenessLock);
+		st = r.dc->staleness[r.key];
+	}
+
+	if (attr == "user.consul.staleness")
+		out = to_string(st.lastContact);
+	else if (attr == "user.consul.knownleader")
+		out = st.knownLeader ? "true" : "false";
+	else
+		out = consistencyName(st.mode);
+
+	return xattrValue(out, value, size);
+}
+
+int consul_listxattr(const char *path, char *list, size_t size)
+{
+	Route r;
+
+	if (!route(path, r) || r.kv.empty())
+		return 0;
+	if (!size)
+		return sizeof(consulXattrs);
+	if (size < sizeof(consulXattrs))
+		return -ERANGE;
+
+	memcpy(list, consulXattrs, sizeof(consulXattrs));
+	return sizeof(consulXattrs);
 }
 
 // rm file
 int consul_unlink(const char *path)
 {
 	stringstream stream;
-	if (consulCURL(apiVers + path, stream, "DELETE"))
+	Route r;
+
+	KVStat st;
+	bool chunked;
+
+	if (!route(path, r) || r.kv.empty())
+		return -ENOENT;
+
+	// A chunked object's chunks go in the same txn as its manifest.  Without
+	// the tree that can't be told cheaply, so every file drops its chunk dir,
+	// whether or not chunks are written here.
+	chunked = !r.key.empty() && r.key[r.key.length() - 1] != '/';
+	if (useTree && r.dc->tree.isLoaded())
+		chunked = r.dc->tree.stat(r.key, st) && !st.isDir && st.flags == chunkFlags;
+
+	if (chunked)
+	{
+		vector<TxnQueue::KVOp> ops;
+
+		ops.push_back(TxnQueue::KVOp("delete", r.key));
+		ops.push_back(TxnQueue::KVOp("delete-tree", chunkDir(r.key)));
+		return commitTogether(*r.dc, ops) ? -EINVAL : 0;
+	}
+
+	if (useTxn)
+	{
+		r.dc->txn.remove(r.key);
+		return 0;
+	}
+
+	if (consulCURL(r.dc->url(r.kv), stream, "DELETE"))
 		return -EINVAL;
+
+	r.dc->cache.erase(r.key);
+	if (useTree)
+		r.dc->tree.remove(r.key);
 	return 0;
 }
 
@@ -323,11 +1519,85 @@ int consul_rmdir(const char *path)
 	return consul_unlink(((string)path + '/').c_str());
 }
 
+// fsync of a directory waits for every queued commit beneath it.
+int consul_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	Route r;
+
+	if (!useTxn || !route(path, r) || !r.dc)
+		return 0;
+	return r.dc->txn.sync(r.key.empty() ? r.key : r.key + '/');
+}
+
+// Bring up every DC known so far.  With the tree on, all of their initial
+// loads go out at once rather than one DC after another.
+void startDCs()
+{
+	vector<Datacenter*> all;
+	vector<hashifuse::HttpRequest> requests;
+
+	{
+		lock_guard<mutex> lk(dcsLock);
+		for (set<string>::iterator name = dcNames.begin(); useTree && name != dcNames.end(); ++name)
+			if (!dcs.count(*name))
+				dcs[*name].reset(new Datacenter(*name, true));
+
+		for (map<string, unique_ptr<Datacenter> >::iterator it = dcs.begin(); it != dcs.end(); ++it)
+			all.push_back(it->second.get());
+	}
+
+	vector<uint64_t> index(all.size(), 0);
+	if (useTree)
+	{
+		Consistency mode = consistencyFor("");
+		for (size_t i = 0; i < all.size(); ++i)
+			requests.push_back(treeRequest(*all[i], 0, mode));
+
+		// Until a load succeeds getattr/readdir fall back to asking Consul.
+		// Too stale a snapshot is redone against the leader.
+		vector<hashifuse::HttpResponse> responses = engine.performAll(requests);
+		for (size_t i = 0; i < all.size(); ++i)
+		{
+			int res;
+			if (tooStale(responses[i], mode))
+				res = loadTree(*all[i], index[i]);
+			else
+			{
+				if (responses[i].code)
+					noteStaleness(*all[i], "", responses[i], mode);
+				res = applyTree(*all[i], responses[i], index[i]);
+			}
+
+			if (res)
+				*logs << RED << "Unable to load KV tree for " << all[i]->name << ", will keep trying" << RESET << endl;
+		}
+	}
+
+	lock_guard<mutex> lk(dcsLock);
+	for (size_t i = 0; i < all.size(); ++i)
+		startDC(all[i], index[i]);
+	dcsStarted = true;
+}
+
 // Init curl subsystem and set up log stream.
 void* consul_init(struct fuse_conn_info *conn)
 {
+	string addr = getenv("CONSUL_HTTP_ADDR") ? getenv("CONSUL_HTTP_ADDR") : "localhost:8500";
+	string token = getenv("CONSUL_HTTP_TOKEN") ? getenv("CONSUL_HTTP_TOKEN") : "";
+	vector<string> headers;
+	Json::Value self;
+	string localName;
+
 	curl_global_init(CURL_GLOBAL_ALL);
 
+	// Note case sensitivity.  Must be "true" lower for effect, or set https in CONSUL_HTTP_ADDR.
+	if (getenv("CONSUL_HTTP_SSL") && (string)getenv("CONSUL_HTTP_SSL") == "true")
+		addr = "https://" + addr;
+
+	if (!token.empty())
+		headers.push_back("X-Consul-Token: " + token);
+	http.configure(addr, headers, 1);
+
 	// Set CONSULFS_LOGS env var to log destination if necessary.
 	// Default to cout, which is ignored without -d or -f arg.
 	if (getenv("CONSULFS_LOG"))
@@ -340,12 +1610,69 @@ void* consul_init(struct fuse_conn_info *conn)
 		}
 	}
 
-	// Set dc global if we need to.
-	//if (getenv("CONSULFS_DC"))
-	//	dc = (string)"dc=" + getenv("CONSULFS_DC");
+	// Prefetch cache bounds.
+	if (getenv("CONSULFS_PREFETCH_MAX"))
+		prefetchMax = strtoull(getenv("CONSULFS_PREFETCH_MAX"), NULL, 10);
+	if (getenv("CONSULFS_CACHE_SIZE"))
+		cacheSize = strtoull(getenv("CONSULFS_CACHE_SIZE"), NULL, 10);
+
+	// Chunks must stay under Consul's value and txn size limits.
+	if (getenv("CONSULFS_CHUNK_SIZE"))
+	{
+		chunkSize = strtoull(getenv("CONSULFS_CHUNK_SIZE"), NULL, 10);
+		if (chunkSize > maxChunkSize)
+			chunkSize = maxChunkSize;
+		else if (chunkSize && chunkSize < 4096)
+			chunkSize = 4096;
+	}
+
+	// Read consistency, optionally per prefix ("app/=consistent,cache/=stale").
+	if (getenv("CONSULFS_CONSISTENCY"))
+		consistency = parseConsistency(getenv("CONSULFS_CONSISTENCY"));
+	if (getenv("CONSULFS_MAX_STALE"))
+		maxStale = atol(getenv("CONSULFS_MAX_STALE"));
+	if (getenv("CONSULFS_CONSISTENCY_PREFIX"))
+	{
+		stringstream rules(getenv("CONSULFS_CONSISTENCY_PREFIX"));
+		string rule;
+
+		while (getline(rules, rule, ','))
+		{
+			size_t eq = rule.rfind('=');
+			if (eq != string::npos)
+				consistencyRules.push_back(make_pair(rule.substr(0, eq), parseConsistency(rule.substr(eq + 1))));
+		}
+
+		sort(consistencyRules.begin(), consistencyRules.end(),
+			[](const pair<string, Consistency> &a, const pair<string, Consistency> &b) { return a.first.length() > b.first.length(); });
+	}
 
 	// TODO check/sanitize env variables for injection.
-	conn->want |= FUSE_CAP_BIG_WRITES;
+	conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ATOMIC_O_TRUNC;
+
+	if (!engine.start())
+		*logs << RED << "Unable to start async engine, requests will block" << RESET << endl;
+
+	useTree = getenv("CONSULFS_TREE") && (string)getenv("CONSULFS_TREE") == "true";
+	useTxn = getenv("CONSULFS_TXN") && (string)getenv("CONSULFS_TXN") == "true";
+	if (getenv("CONSULFS_TXN_WINDOW"))
+		txnWindow = atol(getenv("CONSULFS_TXN_WINDOW"));
+	watching = useTree;
+
+	// /kv is CONSULFS_DC if set, else whatever dc the agent is in.
+	if (refreshDCs())
+		*logs << RED << "Unable to list datacenters, only /kv is available" << RESET << endl;
+	if (getenv("CONSULFS_DC"))
+		localName = getenv("CONSULFS_DC");
+	else if (!consulCURLjson(apiVers + "/agent/self", self))
+		localName = self["Config"]["Datacenter"].asString();
+
+	{
+		lock_guard<mutex> lk(dcsLock);
+		local = new Datacenter(localName, getenv("CONSULFS_DC") != NULL);
+		dcs[localName].reset(local);
+	}
+	startDCs();
 
 	return NULL;
 }
@@ -353,6 +1680,20 @@ void* consul_init(struct fuse_conn_info *conn)
 // Free up curl resources.
 void consul_destroy(void* private_data)
 {
+	lock_guard<mutex> lk(dcsLock);
+
+	// Ship queued commits, then stopping the engine aborts the blocking queries.
+	watching = false;
+	dcsStarted = false;
+	for (map<string, unique_ptr<Datacenter> >::iterator it = dcs.begin(); it != dcs.end(); ++it)
+		it->second->txn.stop();
+
+	engine.stop();
+	for (map<string, unique_ptr<Datacenter> >::iterator it = dcs.begin(); it != dcs.end(); ++it)
+		if (it->second->watcher.joinable())
+			it->second->watcher.join();
+
+	http.close();
 	curl_global_cleanup();
 }
 
@@ -366,13 +1707,21 @@ int main(int argc, char *argv[])
 		.unlink = consul_unlink,
 		.rmdir = consul_rmdir,
 		.truncate = consul_truncate,
+		.open = consul_open,
 		.read = consul_read,
 		.write = consul_write,
 		.statfs = consul_statfs,
+		.flush = consul_flush,
+		.release = consul_release,
+		.fsync = consul_fsync,
+		.getxattr = consul_getxattr,
+		.listxattr = consul_listxattr,
 		.readdir = consul_readdir,
+		.fsyncdir = consul_fsyncdir,
 		.init = consul_init,
 		.destroy = consul_destroy,
 		.create = consul_create,
+		.ftruncate = consul_ftruncate,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
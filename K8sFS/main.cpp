@@ -3,7 +3,7 @@
 ** k8sFS - FUSE2 client for Kubernetes manifests.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
+** Build instructions: make (links ../libhashifuse/libhashifuse.a)
 ** Usage: ./k8sfs -o direct_io /path/to/mount
 **
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
@@ -36,16 +36,21 @@
 #include <fstream>
 #include <mutex>
 #include <regex>
+#include <vector>
 
 #include <fuse.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiFile.h"
 
 using namespace std;
 
 // Set logs to other options via K8SFS_LOG or default to std::cout
 ostream *logs = &cout;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// Shared pooled HTTP client, configured once in k8s_init.
+// FUSE callbacks submit through the async engine and wait on the result.
+hashifuse::HttpClient http;
+hashifuse::HttpEngine engine(http);
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -56,98 +61,30 @@ const char PURPLE[]	= "\e[0;35m";
 const char GREEN[]	= "\e[0;32m";
 const char BLUE[]	= "\e[0;34m";
 
-// CURL callback
-namespace
-{
-    std::size_t write_callback(
-            const char* in,
-            std::size_t size,
-            std::size_t num,
-            char* out)
-    {
-    	if (!out)
-    		return 0;
-    	
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
-
-        #if DEBUG
-		*logs << PURPLE << data << RESET << endl;
-		#endif
-        return size * num;
-    }
-}
-
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
-// TODO: sanitize environment variables for injection vulnerabilities.
 int	k8sCURL(string url, stringstream *httpData = NULL, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
-	const char *addr = getenv("KUBE_APISERVER");
-	const char *token = getenv("KUBE_TOKEN");
-	static const string tokenHead = "Authorization: Bearer ";
-	struct curl_slist *headers = NULL;
-	CURL* c;
-
-	url = addr ? (string)addr + url : "http://localhost:8080" + url;
-	
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	hashifuse::HttpRequest req(url, request, data);
+	hashifuse::HttpResponse res;
+	int httpCode;
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock here.
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case. Could probably use shared curl.
+	if (data != "")
 	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(c = curl_easy_init()))
-			return -1;
-		
-		// Beware error handling (lack).
-		if (token)
-			headers = curl_slist_append(headers, (tokenHead + token).c_str());
-		
-		// Note the ENV variable curl standardizes on has no effect sadly.
-		// TODO: Robustify ca bundle...
-		if (getenv("K8SFS_CA_PEM"))
-			curl_easy_setopt(c, CURLOPT_CAINFO, getenv("K8SFS_CA_PEM"));
-		if (getenv("K8SFS_CLIENT_CERT"))
-			curl_easy_setopt(c, CURLOPT_SSLCERT, getenv("K8SFS_CLIENT_CERT"));
-		
-		if (httpData)
-			curl_easy_setopt(c, CURLOPT_WRITEDATA, httpData);
-
-		if (data != "")
-		{
-			headers = curl_slist_append(headers, "Content-Type: application/json");
-//			headers = curl_slist_append(headers, "Accept: application/json;as=Table;g=meta.k8s.io;v=v1beta1");
-//			headers = curl_slist_append(headers, "Accept: application/json");
-			curl_easy_setopt(c, CURLOPT_POSTFIELDS, data.c_str());
-			#if DEBUG
-			*logs << GREEN << data << RESET << endl;
-			#endif 
-		}
-
-		curl_easy_setopt(c, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, request.c_str());
-		curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(c, CURLOPT_TIMEOUT, 1);
-		curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_callback);
-
-		curl_easy_perform(c);
-
-		curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(c);
-		curl_slist_free_all(headers);
+		req.headers.push_back("Content-Type: application/json");
+//		req.headers.push_back("Accept: application/json;as=Table;g=meta.k8s.io;v=v1beta1");
+//		req.headers.push_back("Accept: application/json");
 	}
 
+	httpCode = engine.perform(req, res);
+	if (httpData)
+		*httpData << res.body;
+
 	// libCurl has a surprise 0 response code sometimes...
-	if (httpCode < 200 || httpCode >= 300)
+	if (httpCode)
 	{
-		*logs << RED << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << RESET << endl;
-		return httpCode ? httpCode : -2;
+		*logs << RED << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << res.code << RESET << endl;
+		return res.code ? httpCode : -2;
 	}
 
 	return 0;
@@ -203,24 +140,42 @@ int k8s_getattr(const char *path, struct stat *stat)
 	return 0;
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
-int k8s_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Fetch the manifest once per open and keep it in fi->fh until release.
+int k8s_open(const char *path, struct fuse_file_info *fi)
 {
-	string data, p(path);
+	hashifuse::FileHandle *fh = new hashifuse::FileHandle();
+	string p(path);
 	stringstream sstream;
 
+	// Write-only opens don't need the current manifest.
 	// TODO adapt this for different types
-	if (k8sCURL(getRESTbase(p) + p + "?pretty=true", &sstream))
-		return -ENOENT;
-	
-	data = sstream.str();
-	if (data.length() - offset <= 0)
-		return 0;
+	if ((fi->flags & O_ACCMODE) != O_WRONLY)
+	{
+		if (k8sCURL(getRESTbase(p) + p + "?pretty=true", &sstream))
+		{
+			delete fh;
+			return -ENOENT;
+		}
+		fh->data = sstream.str();
+	}
+
+	hashifuse::setHandle(fi, fh);
+	return 0;
+}
+
+int k8s_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh = hashifuse::getHandle(fi);
+
+	if (!fh)
+		return -EBADF;
+	return hashifuse::readBuffer(fh->data, buf, size, offset);
+}
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+int k8s_release(const char *path, struct fuse_file_info *fi)
+{
+	hashifuse::freeHandle(fi);
+	return 0;
 }
 
 // Writes are straightforward.  Should verify size < k8s maximum though the API should do that.
@@ -329,8 +284,22 @@ int k8s_statfs(const char *path, struct statvfs *statv)
 // Init curl subsystem and set up log stream.
 void* k8s_init(struct fuse_conn_info *conn)
 {
+	vector<string> headers;
+
 	curl_global_init(CURL_GLOBAL_ALL);
 
+	// TODO: sanitize environment variables for injection vulnerabilities.
+	if (getenv("KUBE_TOKEN"))
+		headers.push_back((string)"Authorization: Bearer " + getenv("KUBE_TOKEN"));
+	http.configure(getenv("KUBE_APISERVER") ? getenv("KUBE_APISERVER") : "http://localhost:8080", headers, 1);
+
+	// Note the ENV variable curl standardizes on has no effect sadly.
+	// TODO: Robustify ca bundle...
+	if (getenv("K8SFS_CA_PEM"))
+		http.setCA(getenv("K8SFS_CA_PEM"));
+	if (getenv("K8SFS_CLIENT_CERT"))
+		http.setClientCert(getenv("K8SFS_CLIENT_CERT"));
+
 	// Default to cout, which is ignored without -d or -f arg.
 	if (getenv("KUBEFS_LOG"))
 	{
@@ -345,12 +314,17 @@ void* k8s_init(struct fuse_conn_info *conn)
 	// Always big writes... 4k may not be enough.
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	if (!engine.start())
+		*logs << RED << "Unable to start async engine, requests will block" << RESET << endl;
+
 	return NULL;
 }
 
 // Free up curl resources.
 void k8s_destroy(void* private_data)
 {
+	engine.stop();
+	http.close();
 	curl_global_cleanup();
 }
 
@@ -364,9 +338,11 @@ int main(int argc, char *argv[])
 		.unlink = k8s_unlink,
 		.chmod = k8s_chmod,
 		.truncate = k8s_truncate,
+		.open = k8s_open,
 		.read = k8s_read,
 		.write = k8s_write,
 		.statfs = k8s_statfs,
+		.release = k8s_release,
 		.readdir = k8s_readdir,
 		.init = k8s_init,
 		.destroy = k8s_destroy,
@@ -0,0 +1,171 @@
+/****************************************************************************
+**
+** JobIndex - in-memory mirror of Nomad's job list for NomadFS.
+**
+** Authored by John Boero
+**
+** Holds the stubs /v1/jobs returns (ID, ModifyIndex, JobModifyIndex,
+** SubmitTime) so getattr/readdir can be answered without a request.  Full
+** listings feed apply() and single events from the event stream update().
+** Spec sizes aren't in the stubs, so they're filled in whenever a spec is
+** fetched and kept until the job's ModifyIndex moves.
+****************************************************************************/
+
+#ifndef NOMAD_JOBINDEX
+#define NOMAD_JOBINDEX
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <time.h>
+#include <json/json.h>
+
+struct JobStat
+{
+	uint64_t	modifyIndex;	// Moves on any change, status included.
+	uint64_t	jobModifyIndex;	// Moves when the spec itself changes.
+	time_t		submitTime;
+	int64_t		size;			// Spec size in bytes, -1 until one is fetched.
+};
+
+class JobIndex
+{
+public:
+	JobIndex() : index(0), loaded(false) {}
+
+	bool isLoaded()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return loaded;
+	}
+
+	uint64_t getIndex()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return index;
+	}
+
+	// Replace everything with a /v1/jobs listing taken at X-Nomad-Index idx.
+	// Entries an event already moved past idx are newer than the listing and stay.
+	// Returns the number of jobs that were added, changed or removed.
+	size_t apply(const Json::Value &stubs, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, JobStat> next;
+		size_t changes = 0;
+
+		for (Json::Value::const_iterator it = stubs.begin(); it != stubs.end(); ++it)
+		{
+			const std::string id = (*it)["ID"].asString();
+			JobStat &st = next[id];
+
+			st = stub(*it);
+
+			// Keep a known size while the job hasn't moved.
+			std::map<std::string, JobStat>::const_iterator old = jobs.find(id);
+			if (old != jobs.end() && old->second.modifyIndex >= st.modifyIndex)
+				st = old->second;
+			else
+				++changes;
+		}
+
+		for (std::map<std::string, JobStat>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+			if (!next.count(it->first))
+			{
+				if (it->second.modifyIndex > idx)
+					next[it->first] = it->second;
+				else
+					++changes;
+			}
+
+		jobs.swap(next);
+		if (idx > index)
+			index = idx;
+		loaded = true;
+		return changes;
+	}
+
+	// One job from an event payload (or any object shaped like a stub) at idx.
+	// Returns false if we already had it at that ModifyIndex or later.
+	bool update(const Json::Value &job, uint64_t idx)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		const JobStat st = stub(job);
+		std::map<std::string, JobStat>::iterator it = jobs.find(job["ID"].asString());
+
+		if (idx > index)
+			index = idx;
+		if (it != jobs.end() && it->second.modifyIndex >= st.modifyIndex)
+			return false;
+
+		jobs[job["ID"].asString()] = st;
+		return true;
+	}
+
+	bool stat(const std::string &id, JobStat &st)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, JobStat>::const_iterator it = jobs.find(id);
+
+		if (it == jobs.end())
+			return false;
+		st = it->second;
+		return true;
+	}
+
+	void list(std::vector<std::string> &ids)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+
+		for (std::map<std::string, JobStat>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+			ids.push_back(it->first);
+	}
+
+	// A spec fetched at modifyIndex.  Ignored if the index has moved past it.
+	void setSize(const std::string &id, uint64_t modifyIndex, size_t size)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		std::map<std::string, JobStat>::iterator it = jobs.find(id);
+
+		if (it != jobs.end() && it->second.modifyIndex == modifyIndex)
+			it->second.size = size;
+	}
+
+	// Local write-through so our own changes show before the watch catches up.
+	void set(const std::string &id, uint64_t jobModifyIndex)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		JobStat &st = jobs[id];
+
+		st.modifyIndex = st.jobModifyIndex = jobModifyIndex;
+		st.submitTime = time(NULL);
+		st.size = -1;
+	}
+
+	void remove(const std::string &id)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		jobs.erase(id);
+	}
+
+private:
+	static JobStat stub(const Json::Value &job)
+	{
+		JobStat st;
+
+		st.modifyIndex = job["ModifyIndex"].asUInt64();
+		st.jobModifyIndex = job["JobModifyIndex"].asUInt64();
+		st.submitTime = (time_t) (job["SubmitTime"].asInt64() / 1000000000);
+		st.size = -1;
+		return st;
+	}
+
+	std::mutex lock;
+	std::map<std::string, JobStat> jobs;
+	uint64_t index;
+	bool loaded;
+};
+
+#endif
@@ -3,14 +3,30 @@
 ** NomadFS - FUSE client for Hashicorp nomad secrets.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
+** Build instructions: make (links ../libhashifuse/libhashifuse.a)
 ** Usage: ./nomadfs -o direct_io /path/to/mount
 **
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
+** Layout: /job/<id>.json job specs, registered on close.  /alloc/<id>/fs is the allocation dir on its client,
+**		/alloc/<id>/logs/<task>.stdout|stderr its task logs (follows while open, for tail -f).
+**		/<region>/<namespace>/job/<id>.json the same job specs in any region and namespace.
 ** Environment Variables: 
 	NOMAD_ADDR			nomad addr.  Example: "https://localhost:4646"
 	NOMAD_TOKEN			optional nomad token for auth.
 	NOMADFS_LOG			optional log file path.
+	NOMADFS_INDEX[=false]	skip mirroring the /v1/jobs stubs with a blocking query and
+						GET each job on getattr instead. default true
+	NOMADFS_EVENTS[=false]	skip the /v1/event/stream connection that keeps the index fresh and
+						long-poll /v1/jobs instead.  Also the fallback when the stream is
+						refused. default true
+	NOMADFS_SCOPE_TTL	ms each /<region>/<namespace>/job listing, and the region and
+						namespace lists, are reused. default 5000
+	NOMADFS_MAX_FOLLOWS	logs that may be open (followed) at once.  Each holds one of the 64
+						pooled connections; more opens fail with EMFILE. default 32
+	NOMADFS_ALLOCS_TTL	ms the /v1/allocations list is reused.  Allocation events from the
+						event stream update it in between. default 5000
+	NOMADFS_CACHE_SIZE	bytes of job specs to keep, reused while the job's ModifyIndex
+						hasn't moved. 0 disables. default 33554432
 ****************************************************************************/
 
 #define FUSE_USE_VERSION 28
@@ -21,16 +37,30 @@
 #include <string.h>
 #include <sstream>
 #include <set>
+#include <map>
 #include <iostream>
 #include <curl/curl.h>
 #include <json/json.h>
 #include <unistd.h>
 #include <fstream>
 #include <mutex>
-#include <set>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
 
-#include "StdColors.h"
+#include "../libhashifuse/StdColors.h"
 #include <fuse.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiFile.h"
+#include "../libhashifuse/HashiCache.h"
+#include "../libhashifuse/HashiUtil.h"
+#include "JobIndex.h"
 
 using namespace std;
 
@@ -42,102 +72,1164 @@ ostream *logs = &cout;
 
 // Keep a set of files (jobs) we've created.  Sadly there's no placeholder or null job.
 set<string> createds;
+mutex createdsLock;
+
+bool isCreated(const string &path)
+{
+	lock_guard<mutex> lk(createdsLock);
+	return createds.count(path) != 0;
+}
+
+// A job file open for writing.  Writes only touch data; flush/release
+// register it once, as a whole.
+struct JobHandle : hashifuse::FileHandle
+{
+	mutex	lock;
+	bool	dirty;
+	int64_t	cas;	// JobModifyIndex to register against: 0 = job must not exist, -1 = don't enforce.
+
+	JobHandle() : dirty(false), cas(-1) {}
+};
+
+// Shared pooled HTTP client, configured once in nomad_init.
+// FUSE callbacks submit through the async engine and wait on the result.
+hashifuse::HttpClient http;
+hashifuse::HttpEngine engine(http);
+
+// Job stubs kept fresh by a blocking query on /v1/jobs, so getattr and
+// readdir don't cost a request per job.  Blocking queries wait up to
+// jobsWait seconds for a change.
+JobIndex jobs;
+bool useIndex = true;
+atomic<bool> watching(false);
+thread watcher;
+const long jobsWait = 300;
+
+// Job specs by ID, versioned by the ModifyIndex they were fetched at.
+hashifuse::ContentCache specs(0);
+size_t specsSize = 32 << 20;
+
+// Instead of long-polling, one connection to /v1/event/stream (Job,
+// Allocation and Deployment topics) applies changes as they happen and
+// picks up from the last index it saw after a drop.
+bool useEvents = true;
+atomic<uint64_t> eventIndex(0);
+atomic<bool> resync(false);
+const long eventsIdle = 35;		// Nomad heartbeats every 10s.
+
+// Allocation list, reused for allocsTtl ms.  Allocation events keep it
+// current in between.
+struct AllocInfo
+{
+	string		jobId;
+	set<string>	tasks;
+	time_t		modifyTime;
+};
+map<string, AllocInfo> allocs;
+mutex allocsLock;
+int64_t allocsLoaded = 0;
+long allocsTtl = 5000;
+
+// Client fs entries seen by the last ls, so ls -l doesn't stat each one.
+struct FsStat
+{
+	bool	isDir;
+	size_t	size;
+	time_t	mtime;
+	int64_t	expires;
+};
+map<string, FsStat> fsAttrs;
+mutex fsAttrsLock;
+const long fsAttrTtl = 2000;
+int64_t fsSwept = 0;
+
+// Followed logs keep logWindow bytes behind the reader.  A read at the end
+// waits up to logWait ms for more before reporting EOF.
+const size_t logWindow = 1 << 20;
+const long logWait = 250;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+// A follow stops taking data once it holds logMax bytes and picks up from
+// there when the reader gets to the end, so a log left open and unread
+// doesn't grow without bound.
+const size_t logMax = 4 << 20;
 
-// CURL callback
-namespace
+// /<region>/<namespace>/job trees.  Each namespace's job list is its own
+// JobIndex, relisted once it's older than scopeTtl ms.  Listing a region
+// (or the root) relists every stale one in a single concurrent batch.
+struct JobScope
 {
-    std::size_t write_callback(
-            const char* in,
-            std::size_t size,
-            std::size_t num,
-            char* out)
-    {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+	const string		region, ns;
+	JobIndex			index;
+	atomic<int64_t>		loaded;		// nowMs() of the last listing, 0 = never.
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
-        return size * num;
-    }
+	JobScope(const string &region, const string &ns) : region(region), ns(ns), loaded(0) {}
+};
+map<string, shared_ptr<JobScope> > scopes;	// By "region/namespace".
+set<string> regions;
+mutex scopesLock;
+int64_t scopesLoaded = 0;
+long scopeTtl = 5000;
+
+int64_t nowMs()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 // Easy libcurl
 // Currently supports request GET (default), PUT, LIST, DELETE
-// TODO: sanitize environment variables for injection vulnerabilities.
 // TODO: change stringstream reference to ptr as we don't always need it.
 int	nomadCURL(string url, stringstream &httpData, string request = "GET", const string data = "")
 {
-	int httpCode = 0;
-	const char *addr = getenv("NOMAD_ADDR");
-	static const string tokenHead = "X-Nomad-Token: ";
-	struct curl_slist *headers = NULL;
-	CURL* curl;
+	hashifuse::HttpResponse res;
+	int httpCode = engine.perform(hashifuse::HttpRequest(url, request, data), res);
+
+	httpData << res.body;
+	if (httpCode)
+	{
+		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << res.code << endl;
+		return httpCode;
+	}
+
+	return 0;
+}
+
+// CURL wrapper with JSON
+int	nomadCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+{
+	stringstream stream;
+	if (nomadCURL(url, stream, request, post))
+		return -EINVAL;
+
+	stream >> jsonData;
+	return 0;
+}
+
+// One /v1/jobs request.  With index set it blocks until the list moves
+// past it (or jobsWait runs out) and the result is folded into jobs.
+int loadJobs(uint64_t &index)
+{
+	hashifuse::HttpRequest req(apiVers + "/jobs?index=" + to_string(index) + "&wait=" + to_string(jobsWait) + "s");
+	hashifuse::HttpResponse res;
+	Json::CharReaderBuilder jsonReader;
+	Json::Value stubs;
+	uint64_t next;
+
+	req.timeout = jobsWait + jobsWait / 16 + 5;
+	if (engine.perform(req, res))
+		return res.code ? (int) res.code : -1;
+
+	next = strtoull(res.header("X-Nomad-Index").c_str(), NULL, 10);
+
+	// Index going backwards (snapshot restore, etc.) means start over.
+	if (next < index)
+	{
+		index = 0;
+		return 0;
+	}
+	if (next == index && jobs.isLoaded())
+		return 0;
+
+	stringstream stream(res.body);
+	if (!Json::parseFromStream(jsonReader, stream, &stubs, NULL))
+		return -EINVAL;
 
-	if (addr)
-		url = (string)addr + url;	// + dc;
-	else
-		url = (string)"http://localhost:4646" + url;
-	
 	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
+	size_t changes = jobs.apply(stubs, next);
+	*logs << CYAN << "Job index at " << next << ", " << changes << " changes" << RESET << endl;
+	#else
+	jobs.apply(stubs, next);
 	#endif
+	index = next;
+	return 0;
+}
+
+// Background long-poll keeping the job index fresh.
+void watchJobs()
+{
+	uint64_t index = 0;
 
-	// Multi-thread mode is a race condition mine field, so we'll just lock here.
-	// Not an issue when single-threaded.  I spent hours on this and this line seems the best fix.
-	// Destructor of lk will release this mutex in any case.
-	{
-		lock_guard<mutex> lk(curlmutex); // DON'T move this -- the race condition gods
-		if (!(curl = curl_easy_init()))
-			return -1;
-		
-		// Beware error handling (lack).
-		if (getenv("NOMAD_TOKEN"))
-			headers = curl_slist_append(headers, (tokenHead + getenv("NOMAD_TOKEN")).c_str());
-		
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str());
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1);
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
-
-		if (data != "")
+	while (watching)
+	{
+		if (loadJobs(index) && watching)
 		{
-			#if DEBUG
-			*logs << YELLOW << data << RESET << endl;
-			#endif 
-			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
+			*logs << RED << "Job index watch failed, retrying" << RESET << endl;
+			this_thread::sleep_for(chrono::seconds(1));
 		}
-		
-		curl_easy_perform(curl);
+	}
+}
+
+// Stub or full allocation from /v1/allocations or an Allocation event.
+AllocInfo allocInfo(const Json::Value &alloc)
+{
+	const Json::Value &states = alloc["TaskStates"];
+	AllocInfo info;
+
+	info.jobId = alloc["JobID"].asString();
+	info.modifyTime = (time_t) (alloc["ModifyTime"].asInt64() / 1000000000);
+
+	// Tasks show up once the client has started the alloc.
+	for (Json::Value::const_iterator it = states.begin(); it != states.end(); ++it)
+		info.tasks.insert(it.key().asString());
+	return info;
+}
+
+// One event from the stream.  Runs on the engine thread, so nothing here may block.
+void applyEvent(const Json::Value &event)
+{
+	const string topic = event["Topic"].asString();
+	const Json::Value &payload = event["Payload"];
 
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
+	if (topic == "Job")
+	{
+		specs.erase(event["Key"].asString());
+		if (payload["Job"].isObject())
+			jobs.update(payload["Job"], event["Index"].asUInt64());
+
+		// A purge and a stop both arrive as JobDeregistered.  A listing tells them apart.
+		if (event["Type"].asString() == "JobDeregistered")
+			resync = true;
 	}
 
-	if (httpCode < 200 || httpCode >= 300)
+	else if (topic == "Allocation" && payload["Allocation"].isObject())
 	{
-		*logs << "Couldn't " << request << " " << data << " -> " << url << " HTTP" << httpCode << endl;
-		return httpCode;
+		lock_guard<mutex> lk(allocsLock);
+		if (allocsLoaded)
+			allocs[payload["Allocation"]["ID"].asString()] = allocInfo(payload["Allocation"]);
+	}
+
+	// Deployments only matter through the job status changes they cause,
+	// which come through as Job events of their own.
+}
+
+// Splits a streaming body into JSON frames as bytes arrive.  Frames end at
+// their closing brace, so NDJSON and back to back objects both work.
+// Nomad's event and log streams both send {} as a heartbeat.
+struct FrameFeed
+{
+	string partial;
+	unique_ptr<Json::CharReader> reader;
+	function<void(const Json::Value &frame)> onFrame;
+	uint64_t frames;
+	size_t scanned, start;
+	int depth;
+	bool inString, escape;
+
+	FrameFeed(function<void(const Json::Value &frame)> onFrame)
+		: reader(Json::CharReaderBuilder().newCharReader()), onFrame(onFrame), frames(0),
+		scanned(0), start(0), depth(0), inString(false), escape(false) {}
+
+	void feed(const char *data, size_t len)
+	{
+		partial.append(data, len);
+		for (; scanned < partial.size(); ++scanned)
+		{
+			const char c = partial[scanned];
+
+			if (inString)
+			{
+				if (escape)
+					escape = false;
+				else if (c == '\\')
+					escape = true;
+				else if (c == '"')
+					inString = false;
+			}
+			else if (c == '"')
+				inString = true;
+			else if (c == '{' && !depth++)
+				start = scanned;
+			else if (c == '}' && depth && !--depth)
+			{
+				Json::Value frame;
+
+				if (reader->parse(partial.data() + start, partial.data() + scanned + 1, &frame, NULL))
+				{
+					onFrame(frame);
+					++frames;
+				}
+			}
+		}
+
+		// Keep only the frame still arriving.
+		const size_t keep = depth ? start : partial.size();
+		partial.erase(0, keep);
+		scanned -= keep;
+		start = 0;
+	}
+};
+
+// Hold the stream open from index until it drops.  Returns frames seen.
+uint64_t streamEvents(uint64_t index, long &code)
+{
+	FrameFeed feed([](const Json::Value &frame)
+	{
+		const Json::Value &events = frame["Events"];
+		for (Json::Value::ArrayIndex i = 0; i < events.size(); ++i)
+			applyEvent(events[i]);
+
+		if (frame["Index"].asUInt64() > eventIndex)
+			eventIndex = frame["Index"].asUInt64();
+	});
+	hashifuse::HttpRequest req(apiVers + "/event/stream?topic=Job&topic=Allocation&topic=Deployment&index=" + to_string(index));
+	hashifuse::HttpResponse res;
+
+	req.timeout = -1;
+	req.idleTimeout = eventsIdle;
+	req.sink = [&feed](const char *data, size_t len) { feed.feed(data, len); return (bool) watching; };
+	future<hashifuse::HttpResponse> pending = engine.submit(req);
+
+	// Listings can't run on the engine thread, so resyncs happen here.
+	while (pending.wait_for(chrono::milliseconds(250)) != future_status::ready)
+		if (resync.exchange(false))
+		{
+			uint64_t fresh = 0;
+			loadJobs(fresh);
+		}
+
+	res = pending.get();
+	code = res.code;
+	return feed.frames;
+}
+
+// Background event stream, reconnecting from the last index seen.  A
+// stream that can't be opened at all forces a fresh listing first, since
+// Nomad may no longer buffer the index we'd resume from.
+void watchEvents()
+{
+	uint64_t index = 0;
+	bool relist = true;
+	long code;
+
+	while (watching)
+	{
+		if (relist)
+		{
+			index = 0;
+			if (loadJobs(index))
+			{
+				if (watching)
+				{
+					*logs << RED << "Unable to list jobs, retrying" << RESET << endl;
+					this_thread::sleep_for(chrono::seconds(1));
+				}
+				continue;
+			}
+			if (index > eventIndex)
+				eventIndex = index;
+		}
+
+		relist = !streamEvents(eventIndex + 1, code);
+		if (!watching)
+			break;
+
+		// Older Nomad, or a token that can't read events.
+		if (code == 403 || code == 404 || code == 501)
+		{
+			*logs << RED << "Event stream unavailable (HTTP" << code << "), long-polling /v1/jobs" << RESET << endl;
+			watchJobs();
+			return;
+		}
+
+		*logs << RED << "Event stream dropped at index " << eventIndex << ", reconnecting" << RESET << endl;
+		if (relist)
+			this_thread::sleep_for(chrono::seconds(1));
 	}
+}
+
+// Map "/job/foo.json" to "foo".
+bool jobId(const string &path, string &id)
+{
+	const string dir = "/job/", ext = ".json";
+
+	if (path.compare(0, dir.length(), dir) || path.length() <= dir.length() + ext.length()
+		|| path.compare(path.length() - ext.length(), ext.length(), ext))
+		return false;
+
+	id = path.substr(dir.length(), path.length() - dir.length() - ext.length());
+	return true;
+}
+
+/*********************************************************************/
+// Regions and namespaces.  /job is the agent's own region and default
+// namespace, kept live by the watch above.  /<region>/<namespace>/job is
+// any other, listed on demand.
+
+string scopeQuery(const JobScope &scope, char sep = '?')
+{
+	return sep + ("region=" + hashifuse::urlEncode(scope.region) + "&namespace=" + hashifuse::urlEncode(scope.ns));
+}
+
+// /v1/regions, then every region's /v1/namespaces in one batch.  Reused for scopeTtl ms.
+int loadScopes()
+{
+	vector<hashifuse::HttpRequest> requests;
+	vector<hashifuse::HttpResponse> responses;
+	map<string, shared_ptr<JobScope> > next;
+	Json::CharReaderBuilder jsonReader;
+	Json::Value names;
+
+	{
+		lock_guard<mutex> lk(scopesLock);
+		if (scopesLoaded && nowMs() - scopesLoaded < scopeTtl)
+			return 0;
+	}
+
+	if (nomadCURLjson(apiVers + "/regions", names) || !names.isArray())
+		return -EIO;
+
+	for (Json::Value::ArrayIndex i = 0; i < names.size(); ++i)
+		requests.push_back(hashifuse::HttpRequest(apiVers + "/namespaces?region=" + hashifuse::urlEncode(names[i].asString())));
+	responses = engine.performAll(requests);
+
+	lock_guard<mutex> lk(scopesLock);
+	regions.clear();
+	for (Json::Value::ArrayIndex i = 0; i < names.size(); ++i)
+	{
+		const string region = names[i].asString();
+		stringstream stream(responses[i].body);
+		Json::Value list;
+
+		// A token that can't list namespaces still has the default one.
+		if (!responses[i].ok() || !Json::parseFromStream(jsonReader, stream, &list, NULL) || !list.isArray())
+		{
+			list = Json::Value(Json::arrayValue);
+			list.append(Json::Value(Json::objectValue))["Name"] = "default";
+		}
+
+		regions.insert(region);
+		for (Json::Value::ArrayIndex j = 0; j < list.size(); ++j)
+		{
+			const string ns = list[j]["Name"].asString(), key = region + '/' + ns;
+			map<string, shared_ptr<JobScope> >::const_iterator old = scopes.find(key);
 
+			// Keep what's been listed so far for scopes that are still there.
+			next[key] = old != scopes.end() ? old->second : make_shared<JobScope>(region, ns);
+		}
+	}
+
+	scopes.swap(next);
+	scopesLoaded = nowMs();
 	return 0;
 }
 
-// CURL wrapper with JSON
-int	nomadCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+bool knownRegion(const string &region)
+{
+	if (loadScopes())
+		return false;
+
+	lock_guard<mutex> lk(scopesLock);
+	return regions.count(region) != 0;
+}
+
+shared_ptr<JobScope> findScope(const string &region, const string &ns)
+{
+	if (loadScopes())
+		return NULL;
+
+	lock_guard<mutex> lk(scopesLock);
+	map<string, shared_ptr<JobScope> >::const_iterator it = scopes.find(region + '/' + ns);
+
+	return it != scopes.end() ? it->second : NULL;
+}
+
+// Every scope, or those of one region.
+vector<shared_ptr<JobScope> > listScopes(const string &region = "")
+{
+	vector<shared_ptr<JobScope> > result;
+
+	lock_guard<mutex> lk(scopesLock);
+	for (map<string, shared_ptr<JobScope> >::const_iterator it = scopes.begin(); it != scopes.end(); ++it)
+		if (region.empty() || it->second->region == region)
+			result.push_back(it->second);
+	return result;
+}
+
+// Relist the stale ones among these scopes, all at once.  A full tree
+// costs one round trip however many namespaces there are.
+void refreshScopes(const vector<shared_ptr<JobScope> > &all)
+{
+	vector<shared_ptr<JobScope> > stale;
+	vector<hashifuse::HttpRequest> requests;
+	vector<hashifuse::HttpResponse> responses;
+	Json::CharReaderBuilder jsonReader;
+	const int64_t now = nowMs();
+
+	for (size_t i = 0; i < all.size(); ++i)
+		if (!all[i]->loaded || now - all[i]->loaded >= scopeTtl)
+		{
+			stale.push_back(all[i]);
+			requests.push_back(hashifuse::HttpRequest(apiVers + "/jobs" + scopeQuery(*all[i])));
+		}
+
+	if (requests.empty())
+		return;
+	responses = engine.performAll(requests);
+
+	for (size_t i = 0; i < stale.size(); ++i)
+	{
+		stringstream stream(responses[i].body);
+		Json::Value stubs;
+
+		if (!responses[i].ok() || !Json::parseFromStream(jsonReader, stream, &stubs, NULL))
+		{
+			*logs << "Couldn't GET -> " << requests[i].url << " HTTP" << responses[i].code << endl;
+			continue;
+		}
+
+		stale[i]->index.apply(stubs, strtoull(responses[i].header("X-Nomad-Index").c_str(), NULL, 10));
+		stale[i]->loaded = nowMs();
+	}
+}
+
+// Split "/<region>/<namespace>/<rest>".  Returns the number of parts present,
+// 1 for "/<region>" up to 3, or 0 for the root and the fixed /job and /alloc.
+// rest keeps its leading slash so it reads like a /job path.
+int scopePath(const string &path, string &region, string &ns, string &rest)
+{
+	size_t slash;
+
+	if (path.length() < 2 || path[0] != '/')
+		return 0;
+
+	slash = path.find('/', 1);
+	region = path.substr(1, slash == string::npos ? string::npos : slash - 1);
+	if (region == "job" || region == "alloc")
+		return 0;
+	if (slash == string::npos || slash + 1 == path.length())
+		return 1;
+
+	const size_t start = slash + 1;
+	slash = path.find('/', start);
+	ns = path.substr(start, slash == string::npos ? string::npos : slash - start);
+	if (slash == string::npos || slash + 1 == path.length())
+		return 2;
+
+	rest = path.substr(slash);
+	return 3;
+}
+
+// A job file, in /job or in one of the scoped trees.
+struct JobPath
+{
+	string id;
+	shared_ptr<JobScope> scope;	// NULL for /job.
+
+	// "?region=..&namespace=.." to pick the scope, nothing for /job.
+	string query(char sep = '?') const
+	{
+		return scope ? scopeQuery(*scope, sep) : "";
+	}
+
+	// Spec cache key.  Plain IDs are /job's, as event Keys are.
+	string key() const
+	{
+		return scope ? scope->region + '/' + scope->ns + '/' + id : id;
+	}
+
+	JobIndex &index() const
+	{
+		return scope ? scope->index : jobs;
+	}
+
+	// Whether index() can answer for this job.  A stale scope is relisted first.
+	bool ready() const
+	{
+		if (!scope)
+			return useIndex && jobs.isLoaded();
+
+		refreshScopes(vector<shared_ptr<JobScope> >(1, scope));
+		return scope->index.isLoaded();
+	}
+};
+
+// Map "/job/foo.json" and "/<region>/<namespace>/job/foo.json" to foo in its scope.
+bool jobPath(const string &path, JobPath &jp)
+{
+	string region, ns, rest;
+
+	jp.scope.reset();
+	if (jobId(path, jp.id))
+		return true;
+	if (scopePath(path, region, ns, rest) != 3 || !jobId(rest, jp.id))
+		return false;
+
+	jp.scope = findScope(region, ns);
+	return jp.scope != NULL;
+}
+
+// A job's spec, from the cache while the index says it hasn't changed.
+// jobModifyIndex, if given, is the spec version for EnforceIndex.
+int fetchSpec(const JobPath &jp, string &spec, uint64_t *jobModifyIndex = NULL)
+{
+	Json::CharReaderBuilder jsonReader;
+	Json::Value job;
+	stringstream sstream;
+	JobStat st;
+	uint64_t version = 0;
+
+	if (jp.ready() && jp.index().stat(jp.id, st)
+		&& specs.get(jp.key(), spec, &version) && version == st.modifyIndex)
+	{
+		if (jobModifyIndex)
+			*jobModifyIndex = st.jobModifyIndex;
+		return 0;
+	}
+
+	if (nomadCURL(apiVers + "/job/" + jp.id + jp.query(), sstream))
+		return -ENOENT;
+	spec = sstream.str();
+
+	if (Json::parseFromStream(jsonReader, sstream, &job, NULL))
+		version = job["ModifyIndex"].asUInt64();
+	if (jobModifyIndex)
+		*jobModifyIndex = job["JobModifyIndex"].asUInt64();
+	specs.put(jp.key(), spec, version);
+	jp.index().setSize(jp.id, version, spec.size());
+	return 0;
+}
+
+// Register a handle's buffer as one job.  It's checked with /v1/validate/job
+// first, then submitted with EnforceIndex against the JobModifyIndex seen at
+// open, so a job changed by someone else in between isn't overwritten.
+int submitJob(const string &path, JobHandle *h)
 {
+	Json::CharReaderBuilder jsonReader;
+	Json::StreamWriterBuilder builder;
+	Json::Value spec, body, result;
 	stringstream stream;
-	if (nomadCURL(url, stream, request, post))
+	string err;
+	JobPath jp;
+	int res;
+
+	lock_guard<mutex> lk(h->lock);
+
+	// An empty placeholder has nothing to register yet.
+	if (!h->dirty || h->data.empty() || !jobPath(path, jp))
+		return 0;
+
+	const string &id = jp.id;
+
+	// One attempt per close.  A failure goes back to the writer from flush;
+	// release shouldn't send the same spec again.
+	h->dirty = false;
+
+	// Either a bare job, as reading the file gives, or {"Job": ...}.
+	stringstream in(h->data);
+	if (!Json::parseFromStream(jsonReader, in, &spec, &err) || !spec.isObject())
+	{
+		*logs << RED << "Job " << id << " is not valid JSON: " << err << RESET << endl;
 		return -EINVAL;
+	}
+	if (spec.isMember("Job") && spec["Job"].isObject())
+	{
+		Json::Value job = spec["Job"];
+		spec.swap(job);
+	}
 
-	stream >> jsonData;
+	// The path decides, so cp a.json b.json creates b rather than rewriting
+	// a, and a spec copied from another namespace lands where it was written.
+	// A Name that just repeated the old ID follows it.
+	if (!spec.isMember("Name") || spec["Name"].asString() == spec["ID"].asString())
+		spec["Name"] = id;
+	spec["ID"] = id;
+	if (jp.scope)
+	{
+		spec["Region"] = jp.scope->region;
+		spec["Namespace"] = jp.scope->ns;
+	}
+	else
+		spec["Namespace"] = "default";
+
+	body["Job"] = spec;
+	builder["indentation"] = "";
+
+	if (nomadCURLjson(apiVers + "/validate/job" + jp.query(), result, "POST", Json::writeString(builder, body)))
+		return -EINVAL;
+	if (result["ValidationErrors"].size() || !result["Error"].asString().empty())
+	{
+		*logs << RED << "Job " << id << " failed validation: " << result["Error"].asString() << RESET << endl;
+		return -EINVAL;
+	}
+
+	if (h->cas >= 0)
+	{
+		body["EnforceIndex"] = true;
+		body["JobModifyIndex"] = (Json::UInt64) h->cas;
+	}
+
+	if ((res = nomadCURL(apiVers + "/jobs" + jp.query(), stream, "POST", Json::writeString(builder, body))))
+	{
+		if (stream.str().find("job modify index") != string::npos || stream.str().find("already exists") != string::npos)
+		{
+			*logs << RED << "Job " << id << " changed since it was opened (JobModifyIndex " << h->cas << ")" << RESET << endl;
+			return -ESTALE;
+		}
+		return -EINVAL;
+	}
+
+	// Show the job right away rather than when the watch catches up.
+	if (Json::parseFromStream(jsonReader, stream, &result, NULL))
+	{
+		h->cas = result["JobModifyIndex"].asUInt64();
+		jp.index().set(id, h->cas);
+	}
+	specs.erase(jp.key());
+
+	lock_guard<mutex> clk(createdsLock);
+	createds.erase(path);
+	return 0;
+}
+
+/*********************************************************************/
+// Allocations.  /alloc/<id>/fs is the allocation dir on its client, read
+// through /v1/client/fs with one readat range request per read.
+// /alloc/<id>/logs/<task>.stdout|stderr hold a follow connection open for
+// as long as the file is, so tail -f gets new lines without polling Nomad.
+
+// Go's RFC3339Nano with any zone offset: "2024-01-02T03:04:05.123456789-05:00"
+time_t parseModTime(const string &stamp)
+{
+	struct tm tm;
+	const char *rest;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!(rest = strptime(stamp.c_str(), "%Y-%m-%dT%H:%M:%S", &tm)))
+		return 0;
+
+	t = timegm(&tm);
+	while (*rest == '.' || isdigit(*rest))
+		++rest;
+	if ((*rest == '+' || *rest == '-') && strlen(rest) >= 6)
+	{
+		const int offset = atoi(rest + 1) * 3600 + atoi(rest + 4) * 60;
+		t += *rest == '+' ? -offset : offset;
+	}
+	return t;
+}
+
+// Split "/alloc/<id>/<area>/<rest>".  Returns the number of parts present,
+// 1 for "/alloc" up to 4, or 0 if this isn't under /alloc at all.
+int allocPath(const string &path, string &id, string &area, string &rest)
+{
+	const string dir = "/alloc";
+	string tail;
+	size_t slash;
+
+	if (path.compare(0, dir.length(), dir) || (path.length() > dir.length() && path[dir.length()] != '/'))
+		return 0;
+	if (path.length() <= dir.length() + 1)
+		return 1;
+
+	tail = path.substr(dir.length() + 1);
+	slash = tail.find('/');
+	id = tail.substr(0, slash);
+	if (slash == string::npos || slash + 1 == tail.length())
+		return 2;
+
+	tail = tail.substr(slash + 1);
+	slash = tail.find('/');
+	area = tail.substr(0, slash);
+	if (slash == string::npos || slash + 1 == tail.length())
+		return 3;
+
+	rest = tail.substr(slash + 1);
+	return 4;
+}
+
+bool underAlloc(const string &path)
+{
+	string id, area, rest;
+	return allocPath(path, id, area, rest) != 0;
+}
+
+// "web.stdout" to ("web", "stdout").
+bool logName(const string &name, string &task, string &type)
+{
+	const size_t dot = name.rfind('.');
+
+	if (dot == string::npos || dot == 0)
+		return false;
+
+	task = name.substr(0, dot);
+	type = name.substr(dot + 1);
+	return type == "stdout" || type == "stderr";
+}
+
+// Refresh the allocation list once it's older than allocsTtl.
+int loadAllocs()
+{
+	map<string, AllocInfo> next;
+	Json::Value list;
+
+	{
+		lock_guard<mutex> lk(allocsLock);
+		if (allocsLoaded && nowMs() - allocsLoaded < allocsTtl)
+			return 0;
+	}
+
+	if (nomadCURLjson(apiVers + "/allocations", list))
+		return -EIO;
+
+	for (Json::Value::const_iterator it = list.begin(); it != list.end(); ++it)
+		next[(*it)["ID"].asString()] = allocInfo(*it);
+
+	lock_guard<mutex> lk(allocsLock);
+	allocs.swap(next);
+	allocsLoaded = nowMs();
+	return 0;
+}
+
+bool findAlloc(const string &id, AllocInfo &info)
+{
+	if (loadAllocs())
+		return false;
+
+	lock_guard<mutex> lk(allocsLock);
+	map<string, AllocInfo>::const_iterator it = allocs.find(id);
+
+	if (it == allocs.end())
+		return false;
+	info = it->second;
+	return true;
+}
+
+string fsQuery(const string &rest)
+{
+	return "?path=" + hashifuse::urlEncode('/' + rest);
+}
+
+void storeFsStat(const string &key, const Json::Value &entry)
+{
+	lock_guard<mutex> lk(fsAttrsLock);
+	const int64_t now = nowMs();
+
+	// Drop what's expired, at most once per TTL, so browsing big alloc dirs
+	// only ever holds about what the last few seconds listed.
+	if (now - fsSwept >= fsAttrTtl)
+	{
+		for (map<string, FsStat>::iterator it = fsAttrs.begin(); it != fsAttrs.end(); )
+			if (now >= it->second.expires)
+				fsAttrs.erase(it++);
+			else
+				++it;
+		fsSwept = now;
+	}
+
+	FsStat &st = fsAttrs[key];
+	st.isDir = entry["IsDir"].asBool();
+	st.size = entry["Size"].asUInt64();
+	st.mtime = parseModTime(entry["ModTime"].asString());
+	st.expires = now + fsAttrTtl;
+}
+
+int fsStat(const string &id, const string &rest, FsStat &st)
+{
+	const string key = id + '/' + rest;
+	Json::Value entry;
+
+	{
+		lock_guard<mutex> lk(fsAttrsLock);
+		map<string, FsStat>::const_iterator it = fsAttrs.find(key);
+		if (it != fsAttrs.end() && nowMs() < it->second.expires)
+		{
+			st = it->second;
+			return 0;
+		}
+	}
+
+	if (nomadCURLjson(apiVers + "/client/fs/stat/" + id + fsQuery(rest), entry))
+		return -ENOENT;
+
+	storeFsStat(key, entry);
+	lock_guard<mutex> lk(fsAttrsLock);
+	st = fsAttrs[key];
+	return 0;
+}
+
+int allocGetattr(const string &path, struct stat *stat)
+{
+	string id, area, rest, task, type;
+	const int parts = allocPath(path, id, area, rest);
+	AllocInfo info;
+	FsStat st;
+
+	stat->st_mode = S_IFDIR | 0500;
+	if (parts == 1)
+		return 0;
+	if (!findAlloc(id, info))
+		return -ENOENT;
+
+	stat->st_atime = stat->st_mtime = stat->st_ctime = info.modifyTime;
+	if (parts == 2 || (parts == 3 && (area == "fs" || area == "logs")))
+		return 0;
+
+	if (area == "logs" && logName(rest, task, type) && info.tasks.count(task))
+	{
+		stat->st_mode = S_IFREG | 0400;
+		return 0;
+	}
+
+	if (area != "fs" || fsStat(id, rest, st))
+		return -ENOENT;
+
+	stat->st_mode = st.isDir ? S_IFDIR | 0500 : S_IFREG | 0400;
+	stat->st_size = st.isDir ? 0 : st.size;
+	stat->st_atime = stat->st_mtime = stat->st_ctime = st.mtime;
+	return 0;
+}
+
+int allocReaddir(const string &path, void *buf, fuse_fill_dir_t filler)
+{
+	string id, area, rest;
+	const int parts = allocPath(path, id, area, rest);
+	AllocInfo info;
+	Json::Value entries;
+
+	if (parts == 1)
+	{
+		if (loadAllocs())
+			return -EIO;
+
+		lock_guard<mutex> lk(allocsLock);
+		for (map<string, AllocInfo>::const_iterator it = allocs.begin(); it != allocs.end(); ++it)
+			filler(buf, it->first.c_str(), NULL, 0);
+		return 0;
+	}
+
+	if (!findAlloc(id, info))
+		return -ENOENT;
+
+	if (parts == 2)
+	{
+		filler(buf, "fs", NULL, 0);
+		filler(buf, "logs", NULL, 0);
+	}
+	else if (area == "logs")
+	{
+		for (set<string>::const_iterator it = info.tasks.begin(); it != info.tasks.end(); ++it)
+		{
+			filler(buf, (*it + ".stdout").c_str(), NULL, 0);
+			filler(buf, (*it + ".stderr").c_str(), NULL, 0);
+		}
+	}
+	else if (area == "fs")
+	{
+		if (nomadCURLjson(apiVers + "/client/fs/ls/" + id + fsQuery(rest), entries))
+			return -ENOENT;
+
+		for (Json::Value::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			const string name = (*it)["Name"].asString();
+			storeFsStat(id + '/' + (rest.empty() ? name : rest + '/' + name), *it);
+			filler(buf, name.c_str(), NULL, 0);
+		}
+	}
+	else
+		return -ENOENT;
+
+	return 0;
+}
+
+// A file in the alloc dir.  Nothing is read until FUSE asks for a range.
+struct FsHandle : hashifuse::FileHandle
+{
+	string alloc, path;
+};
+
+int readAt(const FsHandle &fh, char *buf, size_t size, off_t offset)
+{
+	hashifuse::HttpRequest req(apiVers + "/client/fs/readat/" + fh.alloc + fsQuery(fh.path)
+		+ "&offset=" + to_string(offset) + "&limit=" + to_string(size));
+	hashifuse::HttpResponse res;
+
+	req.maxBody = size;
+	if (engine.perform(req, res))
+	{
+		*logs << "Couldn't read " << fh.path << " in " << fh.alloc << " HTTP" << res.code << endl;
+		return -EIO;
+	}
+
+	memcpy(buf, res.body.data(), res.body.size());
+	return res.body.size();
+}
+
+// What a log follow connection has delivered.  Shared with the engine
+// thread's sink, which may outlive the handle by up to a heartbeat.
+struct LogStream
+{
+	mutex				lock;
+	condition_variable	grew;
+	string				data;
+	off_t				base;		// Log offset of data[0].
+	time_t				mtime;
+	bool				closed;
+
+	LogStream() : base(0), mtime(time(NULL)), closed(false) {}
+};
+
+// Each follow holds one of the engine's connections while it's open, so
+// at most maxFollows (NOMADFS_MAX_FOLLOWS) may be open at once and the rest
+// stay free for readat, listings and the event stream.
+atomic<int> follows(0);
+int maxFollows = 32;
+
+bool claimFollow()
+{
+	int n = follows;
+
+	while (n < maxFollows)
+		if (follows.compare_exchange_weak(n, n + 1))
+			return true;
+	return false;
+}
+
+// A claimed follow.  The handle and each transfer it starts share it, so
+// the claim is only given back once the last of them is gone.
+struct FollowSlot
+{
+	~FollowSlot() { --follows; }
+};
+
+struct LogHandle : hashifuse::FileHandle
+{
+	mutex							lock;
+	string							alloc, task, type;
+	shared_ptr<LogStream>			stream;
+	shared_ptr<FollowSlot>			slot;
+	future<hashifuse::HttpResponse>	pending;
+
+	LogHandle() : stream(make_shared<LogStream>()) {}
+
+	// The sink sees closed on the next frame and aborts the transfer.
+	~LogHandle()
+	{
+		lock_guard<mutex> lk(stream->lock);
+		stream->closed = true;
+	}
+};
+
+// (Re)open the follow connection from where the data we have ends.
+void followLog(LogHandle &lh)
+{
+	shared_ptr<LogStream> stream = lh.stream;
+	shared_ptr<FollowSlot> slot = lh.slot;
+	shared_ptr<FrameFeed> feed = make_shared<FrameFeed>([stream](const Json::Value &frame)
+	{
+		if (!frame["Data"].isString())
+			return;
+
+		const string data = hashifuse::base64Decode(frame["Data"].asString());
+		lock_guard<mutex> lk(stream->lock);
+		stream->data += data;
+		stream->mtime = time(NULL);
+		stream->grew.notify_all();
+	});
+	off_t offset;
+
+	{
+		lock_guard<mutex> lk(stream->lock);
+		offset = stream->base + stream->data.size();
+	}
+
+	hashifuse::HttpRequest req(apiVers + "/client/fs/logs/" + lh.alloc + "?task=" + hashifuse::urlEncode(lh.task)
+		+ "&type=" + lh.type + "&follow=true&origin=start&offset=" + to_string(offset));
+	req.timeout = -1;
+	req.idleTimeout = eventsIdle;
+
+	// Full: drop the connection.  readLog reconnects from the end of data.
+	req.sink = [stream, feed, slot](const char *data, size_t len)
+	{
+		feed->feed(data, len);
+		lock_guard<mutex> lk(stream->lock);
+		return !stream->closed && stream->data.size() < logMax;
+	};
+	lh.pending = engine.submit(req);
+}
+
+int readLog(LogHandle &lh, char *buf, size_t size, off_t offset)
+{
+	lock_guard<mutex> hk(lh.lock);
+	LogStream &s = *lh.stream;
+	unique_lock<mutex> lk(s.lock);
+
+	if (offset < s.base)
+		return -ESPIPE;
+
+	// At the end: give the stream a moment, reconnecting if it dropped.
+	if (offset >= s.base + (off_t) s.data.size())
+	{
+		if (lh.pending.wait_for(chrono::seconds(0)) == future_status::ready)
+		{
+			lk.unlock();
+			hashifuse::HttpResponse res = lh.pending.get();
+			if (res.code >= 400)
+			{
+				*logs << "Couldn't follow " << lh.task << '.' << lh.type << " in " << lh.alloc << " HTTP" << res.code << endl;
+				return -EIO;
+			}
+			followLog(lh);
+			lk.lock();
+		}
+		s.grew.wait_for(lk, chrono::milliseconds(logWait));
+	}
+
+	const size_t from = min((size_t) (offset - s.base), s.data.size());
+	const size_t n = min(size, s.data.size() - from);
+	memcpy(buf, s.data.data() + from, n);
+
+	// Drop what's been read once it's a window behind.
+	if (from + n > logWindow)
+	{
+		const size_t drop = from + n - logWindow;
+		s.data.erase(0, drop);
+		s.base += drop;
+	}
+	return n;
+}
+
+int allocOpen(const string &path, struct fuse_file_info *fi)
+{
+	string id, area, rest;
+	AllocInfo info;
+
+	if (allocPath(path, id, area, rest) != 4 || !findAlloc(id, info))
+		return -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	// Both change underneath us, so never let the page cache answer.
+	fi->direct_io = 1;
+
+	if (area == "logs")
+	{
+		LogHandle *lh = new LogHandle();
+
+		if (!logName(rest, lh->task, lh->type) || !info.tasks.count(lh->task))
+		{
+			delete lh;
+			return -ENOENT;
+		}
+		if (!claimFollow())
+		{
+			delete lh;
+			*logs << RED << "Already following " << maxFollows << " logs, close some first" << RESET << endl;
+			return -EMFILE;
+		}
+		lh->slot = make_shared<FollowSlot>();
+		lh->alloc = id;
+		followLog(*lh);
+		hashifuse::setHandle(fi, lh);
+		return 0;
+	}
+
+	if (area != "fs")
+		return -ENOENT;
+
+	FsHandle *fh = new FsHandle();
+	fh->alloc = id;
+	fh->path = rest;
+	hashifuse::setHandle(fi, fh);
 	return 0;
 }
 
@@ -145,9 +1237,9 @@ int	nomadCURLjson(string url, Json::Value &jsonData, string request = "GET", str
 // Use key trailing slash to identify dir/file.
 int nomad_getattr(const char *path, struct stat *stat)
 {
-	string p(path), key;
-	Json::Value keys;
-	stringstream sstream;
+	string p(path), spec, region, ns, rest;
+	JobPath jp;
+	JobStat st;
 
 	stat->st_uid = getuid();
 	stat->st_gid = getgid();
@@ -167,53 +1259,163 @@ int nomad_getattr(const char *path, struct stat *stat)
 		return 0;
 	}
 
+	if (underAlloc(p))
+		return allocGetattr(p, stat);
+
+	// /<region>, /<region>/<namespace> and its job dir.
+	switch (scopePath(p, region, ns, rest))
+	{
+	case 1:
+		if (!knownRegion(region))
+			return -ENOENT;
+		stat->st_mode = S_IFDIR | 0700;
+		return 0;
+	case 2:
+		if (!findScope(region, ns))
+			return -ENOENT;
+		stat->st_mode = S_IFDIR | 0700;
+		return 0;
+	case 3:
+		if (rest != "/job")
+			break;
+		if (!findScope(region, ns))
+			return -ENOENT;
+		stat->st_mode = S_IFDIR | 0700;
+		return 0;
+	}
+
 	stat->st_mode = S_IFREG | 0600;
 
 	// Is this a blank job we've created locally and are now writing?
-	if (createds.find(path) != createds.end())
+	if (isCreated(path))
 		return 0;
 
 	// Else check if we're in Nomad already.
 	// Chop off ".json" and check if we're 404.  Otherwise we're a file with 600 perms.
-	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p.substr(), sstream))
+	if (!jobPath(p, jp))
 		return -ENOENT;
 
+	// The index answers without a request.  Size is known once the spec has been read.
+	if (jp.ready())
+	{
+		if (!jp.index().stat(jp.id, st))
+			return -ENOENT;
+
+		stat->st_atime = stat->st_mtime = stat->st_ctime = st.submitTime;
+		if (st.size >= 0)
+			stat->st_size = st.size;
+		return 0;
+	}
+
+	if (fetchSpec(jp, spec))
+		return -ENOENT;
+	stat->st_size = spec.size();
+
+	return 0;
+}
+
+// Fetch the job spec once per open and keep it in fi->fh until release.
+int nomad_open(const char *path, struct fuse_file_info *fi)
+{
+	if (underAlloc(path))
+		return allocOpen(path, fi);
+
+	JobHandle *h = new JobHandle();
+	uint64_t jobModifyIndex = 0;
+	JobPath jp;
+
+	// Placeholders we've created start empty and must not exist when submitted.
+	// Otherwise even write-only opens need the JobModifyIndex for EnforceIndex.
+	if (isCreated(path))
+		h->cas = 0;
+	else
+	{
+		// Chop off pseudo ".json" we added.
+		if (!jobPath(path, jp) || fetchSpec(jp, h->data, &jobModifyIndex))
+		{
+			delete h;
+			return -ENOENT;
+		}
+		h->cas = jobModifyIndex;
+	}
+
+	// FUSE_CAP_ATOMIC_O_TRUNC hands us O_TRUNC instead of a separate truncate.
+	if (fi->flags & O_TRUNC)
+	{
+		h->data.clear();
+		h->dirty = true;
+	}
+
+	hashifuse::setHandle(fi, h);
 	return 0;
 }
 
-// Read ops seem fairly simple, but as we need direct_io and can't guess size, 2 reads are necessary.
-// It would be more efficient to read in the entire buffer in OPEN, and free it in RELEASE, but this works.
-// Read once, fetch.  Read again to verify 0 bytes left.  This won't scale with latency.
 int nomad_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	string data, p(path);
-	stringstream sstream;
+	hashifuse::FileHandle *fh = hashifuse::getHandle(fi);
+	FsHandle *ah = dynamic_cast<FsHandle*>(fh);
+	LogHandle *lh = dynamic_cast<LogHandle*>(fh);
 
-	// Chop off pseudo ".json" we added.
-	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p.substr(), sstream))
-		return -ENOENT;
+	if (!fh)
+		return -EBADF;
+	if (ah)
+		return readAt(*ah, buf, size, offset);
+	if (lh)
+		return readLog(*lh, buf, size, offset);
 
-	data = sstream.str();
-	if (data.length() - offset <= 0)
-		return 0;
+	JobHandle *h = static_cast<JobHandle*>(fh);
+	lock_guard<mutex> lk(h->lock);
+	return hashifuse::readBuffer(h->data, buf, size, offset);
+}
+
+// fstat on an open log reports what has arrived so far, so tail -f sees it grow.
+int nomad_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi)
+{
+	LogHandle *lh = dynamic_cast<LogHandle*>(hashifuse::getHandle(fi));
+	int res = nomad_getattr(path, stat);
+
+	if (res || !lh)
+		return res;
+
+	lock_guard<mutex> lk(lh->stream->lock);
+	stat->st_size = lh->stream->base + lh->stream->data.size();
+	stat->st_mtime = lh->stream->mtime;
+	return 0;
+}
+
+// close() lands here, so a failed validation or index check is reported to the writer.
+int nomad_flush(const char *path, struct fuse_file_info *fi)
+{
+	JobHandle *h = dynamic_cast<JobHandle*>(hashifuse::getHandle(fi));
 
-	strncpy(buf + offset, data.c_str(), data.length());
-	return data.length();
+	return h ? submitJob(path, h) : 0;
 }
 
-// Writes are straightforward.  Should verify size < nomad maximum though the API should do that.
+int nomad_release(const char *path, struct fuse_file_info *fi)
+{
+	JobHandle *h = dynamic_cast<JobHandle*>(hashifuse::getHandle(fi));
+	int res = h ? submitJob(path, h) : 0;
+
+	hashifuse::freeHandle(fi);
+	return res;
+}
+
+// Writes only touch the handle buffer, so a spec bigger than one FUSE write
+// is registered once, whole.  Should verify size < nomad maximum though the
+// API will refuse it at flush anyway.
 int nomad_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	stringstream stream;
-	string jobspec = (string) "{\"Job\":" + buf + "}";
+	JobHandle *h = dynamic_cast<JobHandle*>(hashifuse::getHandle(fi));
 
-	if (nomadCURL(apiVers + "/jobs", stream, "POST", jobspec.c_str()))
-		return -EINVAL;
+	if (!h)
+		return -EBADF;
+
+	lock_guard<mutex> lk(h->lock);
+	if (offset + size > h->data.size())
+		h->data.resize(offset + size);
 
-	if (createds.find(path) != createds.end())
-		createds.erase(path);
+	h->data.replace(offset, size, buf, size);
+	h->dirty = true;
 	return size;
 }
 
@@ -237,26 +1439,73 @@ int nomad_statfs(const char *path, struct statvfs *statv)
 // List directory contents.  Currently only /job
 int nomad_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
-	Json::Value jobs;
-	string p(path), f;
-	set<string> names;
+	string p(path), region, ns, rest;
+	vector<shared_ptr<JobScope> > all;
+	shared_ptr<JobScope> scope;
+	vector<string> ids;
+	uint64_t index = 0;
 
 	if (p == "/")
 	{
 		filler(buf, "job", NULL, 0);
+		filler(buf, "alloc", NULL, 0);
+
+		// Regions, with every namespace's jobs listed up front in one batch.
+		if (loadScopes())
+			return 0;
+
+		all = listScopes();
+		refreshScopes(all);
+
+		lock_guard<mutex> lk(scopesLock);
+		for (set<string>::const_iterator it = regions.begin(); it != regions.end(); ++it)
+			if (*it != "job" && *it != "alloc")
+				filler(buf, it->c_str(), NULL, 0);
 		return 0;
 	}
 
-	// Ugly API ambiguity /job /jobs
-	if (p == "/job" && nomadCURLjson(apiVers + "/jobs", jobs))
-		return -ENOENT;
+	if (underAlloc(p))
+		return allocReaddir(p, buf, filler);
 
-	for (Json::Value::const_iterator itr = jobs.begin() ; itr != jobs.end() ; itr++ )
+	switch (scopePath(p, region, ns, rest))
 	{
-		string jobname = (*itr)["ID"].asString();
-		filler(buf, (jobname + ".json").c_str(), NULL, 0);
+	case 1:
+		if (!knownRegion(region))
+			return -ENOENT;
+
+		all = listScopes(region);
+		refreshScopes(all);
+		for (size_t i = 0; i < all.size(); ++i)
+			filler(buf, all[i]->ns.c_str(), NULL, 0);
+		return 0;
+	case 2:
+		if (!findScope(region, ns))
+			return -ENOENT;
+		filler(buf, "job", NULL, 0);
+		return 0;
+	case 3:
+		if (rest != "/job" || !(scope = findScope(region, ns)))
+			return -ENOENT;
+
+		refreshScopes(vector<shared_ptr<JobScope> >(1, scope));
+		scope->index.list(ids);
+		for (vector<string>::const_iterator itr = ids.begin() ; itr != ids.end() ; itr++ )
+			filler(buf, (*itr + ".json").c_str(), NULL, 0);
+		return 0;
 	}
 
+	if (p != "/job")
+		return 0;
+
+	// Ugly API ambiguity /job /jobs
+	// Without a live index, refresh it now: index 0 doesn't block.
+	if (!(useIndex && jobs.isLoaded()) && loadJobs(index))
+		return -ENOENT;
+
+	jobs.list(ids);
+	for (vector<string>::const_iterator itr = ids.begin() ; itr != ids.end() ; itr++ )
+		filler(buf, (*itr + ".json").c_str(), NULL, 0);
+
 	return 0;
 }
 
@@ -266,10 +1515,23 @@ int nomad_truncate(const char *path, off_t newsize)
 	return 0;
 }
 
-// Write a blank key
+int nomad_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+	JobHandle *h = dynamic_cast<JobHandle*>(hashifuse::getHandle(fi));
+
+	if (!h)
+		return nomad_truncate(path, newsize);
+
+	lock_guard<mutex> lk(h->lock);
+	h->data.resize(newsize);
+	h->dirty = true;
+	return 0;
+}
+
+// Jobs are files.  There's no such thing as an empty job to stand in for a dir.
 int nomad_mkdir(const char *path, mode_t mode)
 {
-	return nomad_write(((string)path + '/').c_str(), "", 0, 0, NULL);
+	return -EPERM;
 }
 
 // Ignore any problems here but don't dare return failure. 🇺🇸
@@ -278,7 +1540,18 @@ int nomad_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	// Use a local placeholder.
 	// Nomad doesn't have a null/create job as such
 	// But if we create a file, we need to not return -ENOENT on write.
-	createds.insert(path);
+	JobPath jp;
+
+	if (underAlloc(path) || !jobPath(path, jp))
+		return -EACCES;
+
+	JobHandle *h = new JobHandle();
+	h->cas = 0;
+	{
+		lock_guard<mutex> lk(createdsLock);
+		createds.insert(path);
+	}
+	hashifuse::setHandle(fi, h);
 	return 0;
 }
 
@@ -287,11 +1560,26 @@ int nomad_unlink(const char *path)
 {
 	stringstream stream;
 	string p(path);
+	JobPath jp;
+
+	if (underAlloc(p))
+		return -EACCES;
+
+	// A placeholder that was never registered only exists here.
+	{
+		lock_guard<mutex> lk(createdsLock);
+		if (createds.erase(p))
+			return 0;
+	}
 
 	// Remove the ".json" exention we added.
-	p = p.substr(0, p.length() - 5);
-	if (nomadCURL(apiVers + p + "?purge=true", stream, "DELETE"))
+	if (!jobPath(p, jp))
+		return -ENOENT;
+	if (nomadCURL(apiVers + "/job/" + jp.id + "?purge=true" + jp.query('&'), stream, "DELETE"))
 		return -EINVAL;
+
+	jp.index().remove(jp.id);
+	specs.erase(jp.key());
 	return 0;
 }
 
@@ -303,8 +1591,15 @@ int nomad_chmod(const char *path, mode_t mode)
 // Init curl subsystem and set up log stream.
 void* nomad_init(struct fuse_conn_info *conn)
 {
+	vector<string> headers;
+
 	curl_global_init(CURL_GLOBAL_ALL);
 
+	// TODO: sanitize environment variables for injection vulnerabilities.
+	if (getenv("NOMAD_TOKEN"))
+		headers.push_back((string)"X-Nomad-Token: " + getenv("NOMAD_TOKEN"));
+	http.configure(getenv("NOMAD_ADDR") ? getenv("NOMAD_ADDR") : "http://localhost:4646", headers, 1);
+
 	// Set nomadFS_LOGS env var to log destination if necessary.
 	// Default to cout, which is ignored without -d or -f arg.
 	if (getenv("NOMADFS_LOG"))
@@ -322,7 +1617,29 @@ void* nomad_init(struct fuse_conn_info *conn)
 	//	dc = (string)"dc=" + getenv("NOMAD_DC");
 
 	// Always big writes... 4k may not be enough.
-	conn->want |= FUSE_CAP_BIG_WRITES;
+	conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ATOMIC_O_TRUNC;
+
+	if (getenv("NOMADFS_INDEX") && (string)getenv("NOMADFS_INDEX") == "false")
+		useIndex = false;
+	if (getenv("NOMADFS_ALLOCS_TTL"))
+		allocsTtl = atol(getenv("NOMADFS_ALLOCS_TTL"));
+	if (getenv("NOMADFS_MAX_FOLLOWS"))
+		maxFollows = atoi(getenv("NOMADFS_MAX_FOLLOWS"));
+	if (getenv("NOMADFS_SCOPE_TTL"))
+		scopeTtl = atol(getenv("NOMADFS_SCOPE_TTL"));
+	if (getenv("NOMADFS_CACHE_SIZE"))
+		specsSize = strtoull(getenv("NOMADFS_CACHE_SIZE"), NULL, 10);
+	specs.configure(specsSize, 0);
+
+	if (!engine.start())
+		*logs << RED << "Unable to start async engine, requests will block" << RESET << endl;
+
+	if (getenv("NOMADFS_EVENTS") && (string)getenv("NOMADFS_EVENTS") == "false")
+		useEvents = false;
+
+	watching = useIndex;
+	if (useIndex)
+		watcher = thread(useEvents ? watchEvents : watchJobs);
 
 	return NULL;
 }
@@ -330,6 +1647,14 @@ void* nomad_init(struct fuse_conn_info *conn)
 // Free up curl resources.
 void nomad_destroy(void* private_data)
 {
+	// Stopping the engine aborts the blocking query or event stream.
+	watching = false;
+	engine.stop();
+	if (watcher.joinable())
+		watcher.join();
+
+	specs.clear();
+	http.close();
 	curl_global_cleanup();
 }
 
@@ -343,13 +1668,18 @@ int main(int argc, char *argv[])
 		.unlink = nomad_unlink,
 		.chmod = nomad_chmod,
 		.truncate = nomad_truncate,
+		.open = nomad_open,
 		.read = nomad_read,
 		.write = nomad_write,
 		.statfs = nomad_statfs,
+		.flush = nomad_flush,
+		.release = nomad_release,
 		.readdir = nomad_readdir,
 		.init = nomad_init,
 		.destroy = nomad_destroy,
 		.create = nomad_create,
+		.ftruncate = nomad_ftruncate,
+		.fgetattr = nomad_fgetattr,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
@@ -11,4 +11,7 @@ export ATLAS_TOKEN="[YOURTOKEN]"
 #./tfefs -d -f -s -o direct_io ~/vault
 
 # Not Debug, single thread:
-./tfefs -s -o direct_io ~/vault
+#./tfefs -s -o direct_io ~/vault
+
+# Not Debug, multi-thread:
+./tfefs -o direct_io ~/vault
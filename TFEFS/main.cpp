@@ -3,10 +3,9 @@
 ** tfefs - FUSE client for browsing Hashicorp Terraform Enterprise.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
-** Usage: ./tfefs -s -o direct_io /path/to/mount
+** Build instructions: make (links ../libhashifuse/libhashifuse.a)
+** Usage: ./tfefs -o direct_io /path/to/mount
 **
-** Note single threaded mode is currently mandatory for tfefs (-s flag)
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
 ** Environment Variables: 
 	TFE_ADDR		tfe address, or app.terraform.io by default (SaaS)  Example: "http://localhost:8200"
@@ -27,7 +26,6 @@
 #include <iostream>
 #include <algorithm>
 #include <regex>
-#include <libgen.h>
 
 #include <curl/curl.h>
 #include <json/json.h>
@@ -38,6 +36,8 @@
 #include <sys/xattr.h>
 #include <stdarg.h>
 #include <fuse.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiFile.h"
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -56,100 +56,29 @@ const string apiVers = "/api/v2";
 // Set logs to other options (ofstream) or default to std::cout
 ostream *logs = &cout;
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
-
-// CURL callback
-namespace
-{
-    std::size_t callback(
-            const char* in,
-            std::size_t size,
-            std::size_t num,
-            char* out)
-    {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
-
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
-        return size * num;
-    }
-}
+// Shared pooled HTTP client, configured once in tfe_init.
+// FUSE callbacks submit through the async engine and wait on the result.
+hashifuse::HttpClient http;
+hashifuse::HttpEngine engine(http);
 
 // tfefs GET raw via libcurl
 // Currently supports request GET (default), POST, LIST.
-// TODO: escape environment variables for injection vulnerabilities.
 int	tfeCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
 {
-	int res = 0, httpCode = 0;
-	const char *nsHeader = "Content-Type: application/vnd.api+json";
-	string tokenHeader = "Authorization: Bearer ";
-	struct curl_slist *headers = curl_slist_append(NULL, (tokenHeader + getenv("TFE_TOKEN")).c_str());
-	headers = curl_slist_append(headers, nsHeader);
-	CURL* curl;
-
-	if (getenv("TFE_ADDR"))
-		url = (string)getenv("TFE_ADDR") + url;
-	else
-		url = "https://app.terraform.io" + url;
-	
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	hashifuse::HttpResponse res;
+	int httpCode;
 
-	{
-		lock_guard<mutex> lk(curlmutex);
-	
-		if (!(curl = curl_easy_init()))
-			return -1;
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
-			return res;
-
-		if (res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
-			return res;
+	// Only POST carries a payload.
+	httpCode = engine.perform(hashifuse::HttpRequest(url, request, request == "POST" ? post : ""), res);
+	httpData << res.body;
 
-		if (request == "POST" && post != "")
-		{
-			if (res = curl_easy_setopt(curl, CURLOPT_POST, 1))
-				return res;
-
-			if (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str()))
-				return res;
-	 	}
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
-			return res;
-
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
-
-		// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
-		if (access("~/tfefs.pem", F_OK) != -1)
-			curl_easy_setopt(curl, CURLOPT_CAINFO, "~/tfefs.pem");
-
-		#if DEBUG
-		if (post != "")
-			*logs << YELLOW << post << RESET << endl;
-		#endif 
-
-		curl_easy_perform(curl);
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
-	}
-
-	if (httpCode < 200 || httpCode >= 300)
+	if (httpCode)
 	{
-		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
+		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << res.code << endl;
 		return httpCode;
 	}
 
-	return res;
+	return 0;
 }
 
 int	tfeCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
@@ -166,6 +95,53 @@ int	tfeCURLjson(string url, Json::Value &jsonData, string request = "GET", strin
 	return 0;
 }
 
+// GET every page of a JSON:API listing into one "data" array.
+// Page 1 tells us total-pages, then the rest are fetched concurrently.
+int	tfeCURLpages(string url, Json::Value &data)
+{
+	const string page = (url.find('?') == string::npos ? "?" : "&") + (string)"page[size]=100";
+	vector<hashifuse::HttpRequest> requests;
+	vector<hashifuse::HttpResponse> responses;
+	Json::CharReaderBuilder jsonReader;
+	Json::Value first;
+	int res, pages;
+
+	if ((res = tfeCURLjson(url + page, first)))
+		return res;
+
+	data = first["data"];
+	pages = first["meta"]["pagination"]["total-pages"].asInt();
+
+	for (int i = 2; i <= pages; ++i)
+		requests.push_back(hashifuse::HttpRequest(url + page + "&page[number]=" + to_string(i)));
+	responses = engine.performAll(requests);
+
+	for (size_t i = 0; i < responses.size(); ++i)
+	{
+		Json::Value json;
+		stringstream stream(responses[i].body);
+
+		if (!responses[i].ok() || !Json::parseFromStream(jsonReader, stream, &json, NULL))
+		{
+			*logs << "Couldn't GET -> " << requests[i].url << " HTTP" << responses[i].code << endl;
+			continue;
+		}
+
+		for (Json::Value::ArrayIndex j = 0; j != json["data"].size(); ++j)
+			data.append(json["data"][j]);
+	}
+
+	return 0;
+}
+
+// Last path component.  libgen's basename() may write into its argument,
+// which here would be the path FUSE handed us, shared with other threads.
+string baseName(const string &path)
+{
+	const size_t slash = path.rfind('/');
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
 int tfe_getattr(const char *path, struct stat *stat)
 {
 	const string p(path);
@@ -205,74 +181,88 @@ int tfe_getattr(const char *path, struct stat *stat)
 	return 0;
 }
 
-int tfe_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Fetch the content of a path as it should appear in the file.
+int tfeFetch(const char *path, string &buffer)
 {
-	// To prevent double reads, buffer last read (single thread only!)
-	static string buffer;
 	string p(path), org, workspace, endpoint;
 	const size_t slashes = count(p.begin(), p.end(), '/');
-	Json::Value keys;
-	int len;
+	stringstream stream;
 
-	// Use static buffer to prevent repeat CURL ops
-	if (buffer == "")
+	// 4: workspaces, policies, policy-sets
+	if (slashes > 3)
 	{
-		stringstream stream;
+		// Need to rebase to /api/v2/ and filter on org+ws...
+		//?filter%5Bws%5D%5Bname%5D=my-workspace&filter%5Borganization%5D%5Bname%5D=my-organization
+		// filter[workspace][name]
+		// filter[organization][name]
+		// page[number]
+		// page[size]
+		stringstream sp(p);
+		string ignore, type, org, l5, l6, l7;
+		getline(sp, ignore, '/');	// /
+		getline(sp, ignore, '/');	// orgs
+		getline(sp, org, '/');		// JohnBoero
+		getline(sp, type, '/');	// workspaces,policies,etc
+		getline(sp, l5, '/');		// ws, policy, etc
+		getline(sp, l6, '/');		// plans, applies, runs, etc
+		getline(sp, l7, '/');		// plan, run, etc
 
-		// 4: workspaces, policies, policy-sets
-		if (slashes > 3)
+		if (type == "workspaces")
 		{
-			// Need to rebase to /api/v2/ and filter on org+ws...
-			//?filter%5Bws%5D%5Bname%5D=my-workspace&filter%5Borganization%5D%5Bname%5D=my-organization
-			// filter[workspace][name]
-			// filter[organization][name]
-			// page[number]
-			// page[size]
-			stringstream sp(p);
-			string ignore, type, org, l5, l6, l7;
-			getline(sp, ignore, '/');	// /
-			getline(sp, ignore, '/');	// orgs
-			getline(sp, org, '/');		// JohnBoero
-			getline(sp, type, '/');	// workspaces,policies,etc
-			getline(sp, l5, '/');		// ws, policy, etc
-			getline(sp, l6, '/');		// plans, applies, runs, etc
-			getline(sp, l7, '/');		// plan, run, etc
-
-			if (type == "workspaces")
-			{
-				if (l6 == "vars")
-					endpoint = apiVers + "/vars?filter[organization][name]="
-						+ org + "&filter[workspace][name]=" + l5;
-				else
-					endpoint = apiVers + '/' + l6 + "/" + l7;
-			}
-			else if (regex_match(type, (regex)"policies|policy-sets|ssh-keys"))
-				endpoint = apiVers + '/' + type + "/" + basename((char*)path);
+			if (l6 == "vars")
+				endpoint = apiVers + "/vars?filter[organization][name]="
+					+ org + "&filter[workspace][name]=" + l5;
 			else
-				endpoint = apiVers + '/' + (l6.empty()?l5:l6) + "?filter[organization][name]=" + org 
-					+ "&filter[workspace][name]=" + basename((char*)path);
+				endpoint = apiVers + '/' + l6 + "/" + l7;
 		}
-
-		tfeCURL(endpoint, stream);
-		buffer = stream.str();
+		else if (regex_match(type, (regex)"policies|policy-sets|ssh-keys"))
+			endpoint = apiVers + '/' + type + "/" + baseName(p);
+		else
+			endpoint = apiVers + '/' + (l6.empty()?l5:l6) + "?filter[organization][name]=" + org 
+				+ "&filter[workspace][name]=" + baseName(p);
 	}
 
-	len = min(size, buffer.length() - offset);
+	if (tfeCURL(endpoint, stream))
+		return -ENOENT;
 
-	// We've reached the end of the buffer? (DIRECT_IO)
-	if (offset >= len)
+	buffer = stream.str();
+	return 0;
+}
+
+// Each open gets its own buffer in fi->fh, fetched once.
+int tfe_open(const char *path, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh = new hashifuse::FileHandle();
+	int res;
+
+	if ((fi->flags & O_ACCMODE) != O_WRONLY && (res = tfeFetch(path, fh->data)))
 	{
-		buffer = "";
-		return 0;
+		delete fh;
+		return res;
 	}
-	
-	strncpy(buf + offset, buffer.c_str() + offset, len);
-	return len;
+
+	hashifuse::setHandle(fi, fh);
+	return 0;
+}
+
+int tfe_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh = hashifuse::getHandle(fi);
+
+	if (!fh)
+		return -EBADF;
+	return hashifuse::readBuffer(fh->data, buf, size, offset);
+}
+
+int tfe_release(const char *path, struct fuse_file_info *fi)
+{
+	hashifuse::freeHandle(fi);
+	return 0;
 }
 
 int tfe_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	string p(path + 1), payload(buf);
+	string p(path + 1), payload(buf, size);
 	Json::Value mount, data;
 	Json::StreamWriterBuilder builder;
 	stringstream stream;
@@ -289,7 +279,7 @@ int tfe_write(const char *path, const char *buf, size_t size, off_t offset, stru
 	//payload = "{\"data\":" + payload + "}";
 	//p.insert(mlen, "/data");
 
-	if (tfeCURL(apiVers + '/' + p, stream, "POST", payload.c_str()))
+	if (tfeCURL(apiVers + '/' + p, stream, "POST", payload))
 		return -EINVAL;
 
 	return size;
@@ -354,8 +344,8 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 	else if (slashes == 1)			// /organizations
 	{
 		// List orgs (GET, not LIST....)
-		tfeCURLjson(apiVers + "/organizations", keys);
-		fillArray(keys["data"], buf, filler);
+		tfeCURLpages(apiVers + "/organizations", keys);
+		fillArray(keys, buf, filler);
 	}
 	else if (slashes == 2)			// /organizations/JohnBoero
 	{
@@ -367,8 +357,7 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 	else if (slashes == 3)			// /organizations/JohnBoero/workspaces
 	{
 		// List via GET, not LIST....
-		tfeCURLjson(apiVers + p, keys);
-		keys = keys["data"];
+		tfeCURLpages(apiVers + p, keys);
 
 		for (Json::Value::ArrayIndex i = 0; i != keys.size(); ++i)
 		{
@@ -404,7 +393,7 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		// page[size]
 		stringstream sp(p);
 		string ignore, org, ws;
-		string endpoint = basename((char*)path);
+		string endpoint = baseName(p);
 		getline(sp, ignore, '/');	// /
 		getline(sp, ignore, '/');	// orgs
 		getline(sp, org, '/');		// JohnBoero
@@ -414,8 +403,8 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		endpoint = apiVers + '/' + endpoint + "?filter[organization][name]=" + org 
 			+ "&filter[workspace][name]=" + ws;
 
-		tfeCURLjson(endpoint, keys);
-		fillArray(keys["data"], buf, filler);
+		tfeCURLpages(endpoint, keys);
+		fillArray(keys, buf, filler);
 	}
 
 	return 0;
@@ -423,12 +412,35 @@ int tfe_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 
 void* tfe_init(struct fuse_conn_info *conn)
 {
+	vector<string> headers;
+
 	curl_global_init(CURL_GLOBAL_ALL);
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	// TODO: escape environment variables for injection vulnerabilities.
+	headers.push_back((string)"Authorization: Bearer " + (getenv("TFE_TOKEN") ? getenv("TFE_TOKEN") : ""));
+	headers.push_back("Content-Type: application/vnd.api+json");
+
+	http.configure(getenv("TFE_ADDR") ? getenv("TFE_ADDR") : "https://app.terraform.io", headers, 5);
+
+	// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
+	if (access("~/tfefs.pem", F_OK) != -1)
+		http.setCA("~/tfefs.pem");
+
+	if (!engine.start())
+		*logs << RED << "Unable to start async engine, requests will block" << RESET << endl;
+
 	return NULL;
 }
 
+// Free up curl resources.
+void tfe_destroy(void* private_data)
+{
+	engine.stop();
+	http.close();
+	curl_global_cleanup();
+}
+
 // Need to implement this for truncate/write.
 int tfe_truncate(const char *path, off_t newsize)
 {
@@ -443,11 +455,14 @@ int main(int argc, char *argv[])
 	{
 		.getattr = tfe_getattr,
 		.truncate = tfe_truncate,
+		.open = tfe_open,
 		.read = tfe_read,
 		.write = tfe_write,
 		.statfs = tfe_statfs,
+		.release = tfe_release,
 		.readdir = tfe_readdir,
 		.init = tfe_init,
+		.destroy = tfe_destroy,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
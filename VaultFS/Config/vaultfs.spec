@@ -17,7 +17,7 @@ FUSE filesystem for browsing and managing Hashicorp Vault secrets. Community pro
 
 %build
 cd hashifuse-master/VaultFS
-g++ -g -o %{name} $CFLAGS -D_FILE_OFFSET_BITS=64 -std=c++11 -lfuse -ljsoncpp -lcurl main.cpp
+g++ -g -o %{name} $CFLAGS -D_FILE_OFFSET_BITS=64 -std=c++11 main.cpp ../libhashifuse/*.cpp -lfuse -ljsoncpp -lcurl -lpthread
 
 %install
 mkdir -p %{buildroot}%{_bindir}
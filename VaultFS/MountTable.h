@@ -0,0 +1,102 @@
+/****************************************************************************
+**
+** MountTable - typed snapshot of Vault's /sys/mounts for VaultFS.
+**
+** Authored by John Boero
+**
+** A table is built once from a /sys/mounts response and never modified
+** after that.  Readers take a shared_ptr to the current table and keep
+** using it for the whole callback; a refresh builds a new table and swaps
+** the pointer, so nobody ever sees a half rewritten map.
+****************************************************************************/
+
+#ifndef VAULT_MOUNTTABLE
+#define VAULT_MOUNTTABLE
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdlib.h>
+#include <json/json.h>
+
+struct Mount
+{
+	std::string	path;		// As Vault reports it, with trailing slash: "kv/"
+	std::string	type;
+	int			kvVersion;	// 1 or 2 for kv mounts, 0 for everything else.
+	Json::Value	options;
+};
+
+class MountTable
+{
+public:
+	typedef std::shared_ptr<const MountTable> Ptr;
+
+	// Members that aren't objects with a type (request_id, data, ...) are skipped.
+	static Ptr parse(const Json::Value &json)
+	{
+		std::shared_ptr<MountTable> table(new MountTable());
+
+		for (Json::Value::const_iterator it = json.begin(); it != json.end(); ++it)
+		{
+			if (!(it->isObject() && it->isMember("type") && (*it)["type"].isString()))
+				continue;
+
+			Mount m;
+			m.path = it.key().asString();
+			m.type = (*it)["type"].asString();
+			m.options = (*it)["options"];
+			m.kvVersion = 0;
+
+			// KV version 1 is indicated by options=NULL
+			// whereas version 2, options="version=2"
+			if (m.type == "kv")
+			{
+				m.kvVersion = 1;
+				if (m.options.isObject() && m.options["version"].isString())
+					m.kvVersion = atoi(m.options["version"].asString().c_str());
+			}
+
+			if (m.path.empty() || m.path[m.path.length() - 1] != '/')
+				m.path += '/';
+			table->mounts[m.path] = m;
+		}
+
+		return table;
+	}
+
+	// Longest mount that prefixes path (no leading slash).  NULL if none.
+	const Mount *find(const std::string &path) const
+	{
+		const std::string p = path + '/';
+		const Mount *best = NULL;
+
+		for (std::map<std::string, Mount>::const_iterator it = mounts.begin(); it != mounts.end(); ++it)
+			if (p.compare(0, it->first.length(), it->first) == 0)
+				if (!best || it->first.length() > best->path.length())
+					best = &it->second;
+
+		return best;
+	}
+
+	// Mount paths without their trailing slash.
+	std::vector<std::string> names() const
+	{
+		std::vector<std::string> result;
+
+		for (std::map<std::string, Mount>::const_iterator it = mounts.begin(); it != mounts.end(); ++it)
+			result.push_back(it->first.substr(0, it->first.length() - 1));
+		return result;
+	}
+
+	bool empty() const
+	{
+		return mounts.empty();
+	}
+
+private:
+	std::map<std::string, Mount> mounts;
+};
+
+#endif
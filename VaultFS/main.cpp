@@ -3,14 +3,42 @@
 ** VaultFS - FUSE client for Hashicorp consul secrets.
 **
 ** Authored by John Boero
-** Build instructions: g++ -D_FILE_OFFSET_BITS=64 -lfuse -lcurl -ljsoncpp main.cpp
+** Build instructions: make (links ../libhashifuse/libhashifuse.a)
 ** Usage: ./vaultfs -o direct_io /path/to/mount
 **
 ** Note direct_io is mandatory right now until we can get key size in getattrs.
+** KV v2 mounts report real mtimes, but a secret's size only once its content is
+**		in the cache (VAULTFS_CACHE_SIZE > 0), so direct_io is needed there too.
+** Layout: KV v2 versions are read only files at <dir>/.versions/<secret>/<n>.
+**		Write lines to <transit>/encrypt/<key> or decrypt/<key>, then read the results.
+**		Read <kv dir>/.export.tar for a tar of every secret below it (not listed).
 ** Environment Variables: 
 	VAULT_ADDR		vault addr.  Example: "http://localhost:8200"
 	VAULT_TOKEN		auth token.
 	VAULT_NAMESPACE	optional namespace (enterprise only).
+	VAULTFS_READ_ADDRS	comma separated performance standby addrs (enterprise only) to spread
+						GET/LIST across.  Writes stay on VAULT_ADDR.
+	VAULTFS_MOUNTS_TTL	ms between /sys/mounts refreshes.  Reading sys/mounts also refreshes.
+						0 only refreshes on read. default 60000
+	VAULTFS_CACHE_SIZE	bytes of secret content to cache in memory, wiped on eviction.
+						0 disables. default 33554432
+	VAULTFS_CACHE_TTL	ms a cached secret is served without asking Vault, capped by its
+						lease_duration.  KV v2 secrets are instead revalidated against
+						/metadata current_version on every read. default 30000
+	VAULTFS_CACHE_MOUNTS	per mount overrides.  Example: "secret/=off,aws/=on"
+						default caches kv, cubbyhole and pki mounts only
+	VAULTFS_CERT_CACHE_SIZE	bytes of issued certificate bodies (pki certs/<serial>) to keep.
+						They never change so they never expire. 0 disables. default 67108864
+	VAULTFS_PKI_TTL		ms the CA, CRL, ca_chain and other pki reads are cached. default 5000
+	VAULTFS_ATTR_TTL	ms KV v2 metadata (mtime, version) is trusted for getattr. default 5000
+	VAULTFS_TRANSIT_BATCH	lines per batch_input request to transit/encrypt|decrypt/<key>. default 250
+	VAULTFS_TRANSIT_INFLIGHT	transit batches in flight per open file. default 4
+	VAULTFS_TRANSIT_TTL	ms transit results stay readable after close, then wiped. default 60000
+	VAULTFS_EXPORT_INFLIGHT	concurrent LIST/GET requests while streaming .export.tar. default 32
+	VAULTFS_PERMS[=false]	skip the capabilities-self query readdir makes for real mode bits. default true
+	VAULTFS_CREDPOOL	dynamic credentials to issue ahead of time, as path=size[:low].  Each open
+						takes one and the pool refills below low (default half).  Unused leases
+						are revoked at unmount.  Example: "aws/creds/deploy=4,database/creds/ro=2:1"
 
 ** This code is kept fairly simple/ugly without object oriented best practices.
 ** TODO: securely destroy strings - https://stackoverflow.com/questions/5698002/how-does-one-securely-clear-stdstring
@@ -25,6 +53,8 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <iostream>
 #include <algorithm>
 #include <regex>
@@ -33,11 +63,23 @@
 #include <json/json.h>
 
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <fstream>
 #include <unistd.h>
 #include <sys/xattr.h>
 #include <stdarg.h>
 #include <fuse.h>
+#include "../libhashifuse/HashiAsync.h"
+#include "../libhashifuse/HashiFile.h"
+#include "../libhashifuse/HashiCache.h"
+#include "../libhashifuse/HashiUtil.h"
+#include "../libhashifuse/HashiTar.h"
+#include "../libhashifuse/HashiJson.h"
+#include "MountTable.h"
 
 // Term colors for stdout
 const char RESET[]	= "\033[0m";
@@ -56,324 +98,1585 @@ const string apiVers = "/v1";
 // Set logs to other options (ofstream) or default to std::cout
 ostream *logs = &cout;
 
-// Keep/cache a local copy of mount->mount_type for speed.
-static Json::Value gMounts;
+// Keep/cache a local copy of /sys/mounts for speed.
+// Snapshots are immutable and swapped whole, so only touch gMounts via mounts().
+static MountTable::Ptr gMounts(new MountTable());
+static atomic<int64_t> mountsLoaded(0);
+static mutex mountsRefresh;
+static int64_t mountsTtl = 60000;
+
+// Secret content by path.  Dynamic engines hand out new creds per read,
+// so only static ones are cached unless VAULTFS_CACHE_MOUNTS says otherwise.
+static hashifuse::ContentCache contentCache(0);
+static size_t cacheSize = 32 << 20;
+static long cacheTtl = 30000;
+static map<string, bool> cachePolicy;
+static const char *cacheTypes[] = {"kv", "generic", "cubbyhole", "pki", NULL};
+
+// Issued certificates never change, so pki/certs/<serial> bodies are kept
+// until evicted, in their own cache so an audit of every cert can't push
+// secrets out.  The CA, CRL and chain do get reissued: short TTL only.
+static hashifuse::ContentCache certCache(0);
+static size_t certCacheSize = 64 << 20;
+static long pkiTtl = 5000;
+
+// Shared pooled HTTP client, configured once in vault_init.
+// FUSE callbacks submit through the async engine and wait on the result.
+hashifuse::HttpClient http;
+hashifuse::HttpEngine engine(http);
+
+// Optional read endpoints (performance standbys).  GET and LIST rotate
+// across them while everything else goes to VAULT_ADDR, the active node.
+// Reads carry the X-Vault-Index of our last write so a standby that hasn't
+// caught up forwards to the active node: we always read our own writes.
+static vector<string> readAddrs;
+static atomic<size_t> readNext(0);
+static mutex indexLock;
+static string lastIndex;
+
+hashifuse::HttpRequest vaultRequest(const string &url, const string &request = "GET", const string &post = "")
+{
+	// Only POST carries a payload.
+	hashifuse::HttpRequest req(url, request, request == "POST" ? post : "");
+
+	if (readAddrs.empty() || (request != "GET" && request != "LIST"))
+		return req;
+
+	req.url = readAddrs[readNext++ % readAddrs.size()] + url;
+	req.headers.push_back("X-Vault-Inconsistent: forward-active-node");
+
+	lock_guard<mutex> lk(indexLock);
+	if (!lastIndex.empty())
+		req.headers.push_back("X-Vault-Index: " + lastIndex);
+	return req;
+}
+
+// A standby that's down or refuses (412) shouldn't fail the read.  If req
+// went to one and got either, point it at the active node and say so.
+bool toActive(hashifuse::HttpRequest &req, const hashifuse::HttpResponse &res)
+{
+	if (res.code != 0 && res.code != 412)
+		return false;
+
+	for (vector<string>::const_iterator addr = readAddrs.begin(); addr != readAddrs.end(); ++addr)
+		if (req.url.compare(0, addr->length(), *addr) == 0)
+		{
+			req.url.erase(0, addr->length());
+			req.headers.clear();
+			return true;
+		}
+	return false;
+}
+
+// performAll with the same fallback, retrying the refused reads together.
+vector<hashifuse::HttpResponse> vaultPerformAll(vector<hashifuse::HttpRequest> requests)
+{
+	vector<hashifuse::HttpResponse> responses = engine.performAll(requests);
+	vector<hashifuse::HttpRequest> retry;
+	vector<size_t> at;
+
+	for (size_t i = 0; i < requests.size(); ++i)
+		if (toActive(requests[i], responses[i]))
+		{
+			retry.push_back(requests[i]);
+			at.push_back(i);
+		}
+
+	if (!retry.empty())
+	{
+		vector<hashifuse::HttpResponse> again = engine.performAll(retry);
+		for (size_t i = 0; i < at.size(); ++i)
+			responses[at[i]] = again[i];
+	}
+	return responses;
+}
+
+void noteIndex(const hashifuse::HttpResponse &res)
+{
+	const string index = res.header("x-vault-index");
+
+	if (!index.empty())
+	{
+		lock_guard<mutex> lk(indexLock);
+		lastIndex = index;
+	}
+}
+
+// Vault GET raw via libcurl
+// Currently supports request GET (default), POST, LIST.
+int	vaultCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
+{
+	hashifuse::HttpRequest req = vaultRequest(url, request, post);
+	hashifuse::HttpResponse res;
+	int httpCode;
+
+	httpCode = engine.perform(req, res);
+	if (toActive(req, res))
+		httpCode = engine.perform(req, res);
+	if (req.url == url)
+		noteIndex(res);
+	httpData << res.body;
+
+	if (httpCode)
+	{
+		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << res.code << endl;
+		return httpCode;
+	}
+
+	return 0;
+}
+
+int	vaultCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+{
+	stringstream stream;
+	Json::CharReaderBuilder jsonReader;
+	int	res = 0;
+
+	if (res = vaultCURL(url, stream, request, post))
+		return res;
+
+	stream >> jsonData;
+
+	return 0;
+}
+
+// LIST that hands each key to fill as the body arrives instead of parsing
+// the whole response.  Blocks on this thread so fill can go straight to FUSE.
+int	vaultListStream(const string &url, function<void(const string &key)> fill)
+{
+	hashifuse::JsonArrayScanner scanner(vector<string>{"data", "keys"}, fill);
+	hashifuse::HttpRequest req = vaultRequest(url, "LIST");
+	hashifuse::HttpResponse res;
+	int httpCode;
+
+	req.sink = [&scanner](const char *data, size_t len) { scanner.feed(data, len); return true; };
+	httpCode = http.perform(req, res);
+
+	// Same standby fallback as vaultCURL, as long as nothing was filled yet.
+	if (!scanner.count() && toActive(req, res))
+		httpCode = http.perform(req, res);
+
+	if (httpCode)
+	{
+		*logs << "Couldn't LIST -> " << url << " HTTP" << res.code << endl;
+		return httpCode;
+	}
+
+	return 0;
+}
+
+static int64_t nowMs()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Swap in a new snapshot built from a /sys/mounts response.
+// Readers holding the old one keep it alive until they're done.
+bool publishMounts(const Json::Value &json)
+{
+	MountTable::Ptr table = MountTable::parse(json);
+
+	if (table->empty())
+		return false;
+
+	atomic_store(&gMounts, table);
+	mountsLoaded = nowMs();
+	return true;
+}
+
+// File content for a secret response.
+// Because some secret engines have ".data.data"...
+// Beware someone actually calling a secret "data"
+string renderSecret(Json::Value data)
+{
+	Json::StreamWriterBuilder builder;
+
+	while (data.isObject() && data.isMember("data"))
+		data = data["data"];
+	return Json::writeString(builder, data);
+}
+
+// Cache /sys/mounts for speed.
+int cacheMounts()
+{
+	Json::Value json;
+
+	if (vaultCURLjson(apiVers + "/sys/mounts", json) || !publishMounts(json))
+		return -EINVAL;
+	return 0;
+}
+
+// Current mounts snapshot.  When the TTL lapses one caller refreshes
+// while everybody else carries on with the table they already have.
+MountTable::Ptr mounts()
+{
+	if (mountsTtl > 0 && nowMs() - mountsLoaded >= mountsTtl)
+	{
+		unique_lock<mutex> lk(mountsRefresh, try_to_lock);
+		if (lk.owns_lock() && nowMs() - mountsLoaded >= mountsTtl && cacheMounts())
+			mountsLoaded = nowMs();	// Don't retry on every call while Vault is unhappy.
+	}
+
+	return atomic_load(&gMounts);
+}
+
+void wipe(string &s)
+{
+	fill(s.begin(), s.end(), '\0');
+	s.clear();
+}
+
+// VAULTFS_CACHE_MOUNTS, else the default types.  Each cache checks its
+// own size on top of this.
+bool cachedMount(const Mount &mount)
+{
+	map<string, bool>::const_iterator it = cachePolicy.find(mount.path);
+
+	if (it != cachePolicy.end())
+		return it->second;
+
+	for (const char **type = cacheTypes; *type; ++type)
+		if (mount.type == *type)
+			return true;
+	return false;
+}
+
+bool cacheable(const Mount &mount)
+{
+	return contentCache.enabled() && cachedMount(mount);
+}
+
+// Cached content for path, if still good.  KV v2 entries remember the
+// version they were read at and are checked against the metadata, which
+// costs a request but never moves the secret itself.
+bool cachedSecret(const Mount &mount, const string &path, string &raw)
+{
+	Json::Value meta;
+	uint64_t version;
+
+	if (!contentCache.get(path, raw, &version))
+		return false;
+	if (mount.kvVersion != 2)
+		return true;
+
+	if (!vaultCURLjson(apiVers + '/' + mount.path + "metadata/" + path.substr(mount.path.length()), meta))
+	{
+		const Json::Value &info = meta["data"];
+		const Json::Value &current = info["versions"][to_string(info["current_version"].asUInt64())];
+
+		// Deleted or destroyed versions keep current_version, so check those too.
+		if (info["current_version"].asUInt64() == version && !current["destroyed"].asBool()
+			&& current["deletion_time"].asString().empty())
+			return true;
+	}
+
+	contentCache.erase(path);
+	wipe(raw);
+	return false;
+}
+
+// Expiry for a fresh read: the lease if it's shorter than our TTL.
+// KV v2 entries never expire on their own since every hit is revalidated.
+long cacheTtlFor(const Mount &mount, const Json::Value &response)
+{
+	const long lease = response["lease_duration"].isIntegral() ? response["lease_duration"].asInt() * 1000L : 0;
+
+	if (mount.kvVersion == 2)
+		return 0;
+	if (lease > 0 && (cacheTtl <= 0 || lease < cacheTtl))
+		return lease;
+	return cacheTtl;
+}
+
+string getMountType(string path)
+{
+	if (path[0] == '/')
+		path = path.substr(1);
+
+	MountTable::Ptr table = mounts();
+	const Mount *mount = table->find(path);
+
+	return mount ? mount->type : "";
+}
+
+/*********************************************************************/
+// KV v2 metadata.
+// Each secret's /metadata gives its current version and updated_time, so
+// getattr can report real mtimes and, once the content has been read,
+// real sizes.  Old versions are browsable (read only) at
+// dir/.versions/secret/<n>, and as versions never change they're cached
+// without expiry.
+
+struct SecretAttr
+{
+	bool		isDir, deleted, sized;
+	uint64_t	version;				// current_version
+	time_t		mtime;					// updated_time
+	size_t		size;					// Of the current version's content, once sized.
+	map<uint64_t, time_t>	versions;	// Readable versions and their created_time.
+	chrono::steady_clock::time_point	expires;
+
+	SecretAttr() : isDir(false), deleted(false), sized(false), version(0), mtime(0), size(0) {}
+};
+
+static mutex attrsLock;
+static map<string, SecretAttr> attrs;
+static long attrTtl = 5000;
+static const string versionsDir = ".versions";
+
+int vaultFetch(string p, string &raw);
+
+// Vault timestamps are RFC3339 UTC: "2018-03-22T02:24:06.945319214Z"
+time_t parseTime(const string &stamp)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(stamp.c_str(), "%Y-%m-%dT%H:%M:%S", &tm))
+		return 0;
+	return timegm(&tm);
+}
+
+// Splits a path inside a KV v2 mount around its .versions component:
+// "dir/.versions/secret/3".  Returns how many of secret and version follow
+// .versions (0-2), -1 for an ordinary path, or 3 for anything deeper.
+int versionsPath(const string &rel, string &dir, string &name, string &version)
+{
+	const string wrapped = '/' + rel + '/';
+	size_t at = wrapped.find('/' + versionsDir + '/'), slash;
+
+	if (at == string::npos)
+		return -1;
+
+	dir = rel.substr(0, at ? at - 1 : 0);
+	string rest = wrapped.substr(at + versionsDir.length() + 2);
+	if (rest.empty())
+		return 0;
+
+	rest.pop_back();
+	if ((slash = rest.find('/')) == string::npos)
+	{
+		name = rest;
+		return 1;
+	}
+
+	name = rest.substr(0, slash);
+	version = rest.substr(slash + 1);
+	if (version.empty() || version.find_first_not_of("0123456789") != string::npos)
+		return 3;
+	return 2;
+}
+
+void parseSecretAttr(const Json::Value &info, SecretAttr &attr)
+{
+	const Json::Value &versions = info["versions"];
+
+	attr.isDir = false;
+	attr.version = info["current_version"].asUInt64();
+	attr.mtime = parseTime(info["updated_time"].asString());
+	attr.versions.clear();
+
+	for (Json::Value::const_iterator it = versions.begin(); it != versions.end(); ++it)
+		if (!(*it)["destroyed"].asBool() && (*it)["deletion_time"].asString().empty())
+			attr.versions[strtoull(it.key().asString().c_str(), NULL, 10)] = parseTime((*it)["created_time"].asString());
+
+	attr.deleted = !attr.versions.count(attr.version);
+}
+
+// Remember attrs for path.  Sizes carry over while the version holds.
+void storeAttr(const string &path, SecretAttr attr)
+{
+	lock_guard<mutex> lk(attrsLock);
+	map<string, SecretAttr>::iterator it = attrs.find(path);
+
+	if (it != attrs.end() && it->second.sized && !attr.sized && !attr.isDir && it->second.version == attr.version)
+	{
+		attr.sized = true;
+		attr.size = it->second.size;
+	}
+
+	attr.expires = chrono::steady_clock::now() + chrono::milliseconds(attrTtl);
+	attrs[path] = attr;
+}
+
+// Attrs for a secret or directory below a KV v2 mount.  False if neither.
+bool secretAttr(const Mount &mount, const string &key, SecretAttr &attr)
+{
+	const string path = mount.path + key;
+	Json::Value meta, keys;
+
+	{
+		lock_guard<mutex> lk(attrsLock);
+		map<string, SecretAttr>::const_iterator it = attrs.find(path);
+		if (it != attrs.end() && chrono::steady_clock::now() < it->second.expires)
+		{
+			attr = it->second;
+			return true;
+		}
+	}
+
+	if (!vaultCURLjson(apiVers + '/' + mount.path + "metadata/" + key, meta))
+		parseSecretAttr(meta["data"], attr);
+	else if (!vaultCURLjson(apiVers + '/' + mount.path + "metadata/" + key, keys, "LIST")
+		&& keys["data"]["keys"].size())
+		attr.isDir = true;
+	else
+		return false;
+
+	storeAttr(path, attr);
+	return true;
+}
+
+// Content of one old version.  Never revalidated: versions are immutable.
+int fetchVersion(const Mount &mount, const string &path, const string &key, const string &version, string &raw)
+{
+	Json::Value data;
+
+	if (contentCache.get(path, raw))
+		return 0;
+
+	if (vaultCURLjson(apiVers + '/' + mount.path + "data/" + key + "?version=" + version, data)
+		|| data["data"]["data"].isNull())
+		return -ENOENT;
+
+	// Rendered like vaultFetch so a version reads like the secret did.
+	raw = renderSecret(data);
+	if (cacheable(mount))
+		contentCache.put(path, raw, strtoull(version.c_str(), NULL, 10), 0);
+	return 0;
+}
+
+// Size of path's content at version, only if that version is already
+// cached.  getattr never reads a secret just to size it.
+bool contentSize(const string &path, uint64_t version, size_t &size)
+{
+	string raw;
+	uint64_t cached;
+	bool found = contentCache.get(path, raw, &cached) && cached == version;
+
+	if (found)
+		size = raw.size();
+
+	fill(raw.begin(), raw.end(), '\0');
+	return found;
+}
+
+int kv2Getattr(const Mount &mount, const string &path, struct stat *stat)
+{
+	const string rel = path.substr(mount.path.length());
+	string dir, name, version;
+	SecretAttr attr;
+	int parts = versionsPath(rel, dir, name, version);
+	const string key = dir.empty() ? name : dir + '/' + name;
+
+	stat->st_mode = S_IFDIR | 0500;
+	switch (parts)
+	{
+	case -1:
+		if (!secretAttr(mount, rel, attr) || attr.deleted)
+			return -ENOENT;
+		if (attr.isDir)
+		{
+			stat->st_mode = S_IFDIR | 0700;
+			return 0;
+		}
+
+		// Until the secret has been read (and cached) its size is 0, so only
+		// direct_io reads it whole.
+		if (!attr.sized && contentSize(path, attr.version, attr.size))
+		{
+			attr.sized = true;
+			storeAttr(path, attr);
+		}
+
+		stat->st_mode = S_IFREG | 0600;
+		stat->st_size = attr.size;
+		stat->st_atime = stat->st_mtime = stat->st_ctime = attr.mtime;
+		return 0;
+
+	case 0:
+		if (!dir.empty() && !(secretAttr(mount, dir, attr) && attr.isDir))
+			return -ENOENT;
+		return 0;
+
+	case 1:
+		if (!secretAttr(mount, key, attr) || attr.isDir || attr.versions.empty())
+			return -ENOENT;
+		stat->st_atime = stat->st_mtime = stat->st_ctime = attr.mtime;
+		return 0;
+
+	case 2:
+		if (!secretAttr(mount, key, attr) || attr.isDir || !attr.versions.count(strtoull(version.c_str(), NULL, 10)))
+			return -ENOENT;
+
+		stat->st_mode = S_IFREG | 0400;
+		if (!contentSize(path, strtoull(version.c_str(), NULL, 10), attr.size))
+			attr.size = 0;
+		stat->st_size = attr.size;
+		stat->st_atime = stat->st_mtime = stat->st_ctime = attr.versions[strtoull(version.c_str(), NULL, 10)];
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+// List a directory (or its .versions) below a KV v2 mount.  Metadata for
+// every secret listed is fetched concurrently so the getattr storm from
+// ls -l/rsync that follows is answered from attrs.
+int kv2Readdir(const Mount &mount, const string &path, void *buf, fuse_fill_dir_t filler)
+{
+	const string rel = path.length() > mount.path.length() ? path.substr(mount.path.length()) : "";
+	string dir, name, version;
+	Json::Value keys;
+	vector<hashifuse::HttpRequest> requests;
+	vector<string> secrets;
+	set<string> names;
+	SecretAttr attr;
+	int parts = versionsPath(rel, dir, name, version);
+
+	if (parts > 1)
+		return -ENOTDIR;
+
+	if (parts == 1)
+	{
+		if (!secretAttr(mount, dir.empty() ? name : dir + '/' + name, attr) || attr.isDir)
+			return -ENOENT;
+		for (map<uint64_t, time_t>::const_iterator it = attr.versions.begin(); it != attr.versions.end(); ++it)
+			filler(buf, to_string(it->first).c_str(), NULL, 0);
+		return 0;
+	}
+
+	const string listed = parts == 0 ? dir : rel;
+	const string prefix = listed.empty() ? "" : listed + '/';
+	if (vaultCURLjson(apiVers + '/' + mount.path + "metadata/" + listed, keys, "LIST"))
+		return -ENOENT;
+
+	const Json::Value &list = keys["data"]["keys"];
+	for (Json::Value::ArrayIndex i = 0; i != list.size(); ++i)
+	{
+		const string k = list[i].asString();
+		if (!k.empty() && k[k.length() - 1] != '/')
+		{
+			secrets.push_back(k);
+			requests.push_back(vaultRequest(apiVers + '/' + mount.path + "metadata/" + prefix + k));
+		}
+	}
+
+	vector<hashifuse::HttpResponse> responses = vaultPerformAll(requests);
+	for (size_t i = 0; i < secrets.size(); ++i)
+	{
+		Json::Value meta;
+		stringstream body(responses[i].body);
+
+		// Couldn't tell, so list it and let getattr decide.
+		if (!responses[i].ok() || !(body >> meta))
+		{
+			names.insert(secrets[i]);
+			continue;
+		}
+
+		parseSecretAttr(meta["data"], attr);
+		storeAttr(mount.path + prefix + secrets[i], attr);
+
+		// Deleted secrets only live on in .versions.
+		if (parts == 0 ? !attr.versions.empty() : !attr.deleted)
+			names.insert(secrets[i]);
+	}
+
+	if (parts == -1)
+	{
+		// Dirs take precedence over a secret of the same name.
+		attr = SecretAttr();
+		attr.isDir = true;
+		for (Json::Value::ArrayIndex i = 0; i != list.size(); ++i)
+		{
+			string k = list[i].asString();
+			if (k.empty() || k[k.length() - 1] != '/')
+				continue;
+
+			k.pop_back();
+			storeAttr(mount.path + prefix + k, attr);
+			names.insert(k);
+		}
+
+		if (!secrets.empty())
+			names.insert(versionsDir);
+	}
 
-// Protect multi-threaded mode from libcurl/libopenssl race condition.
-mutex curlmutex;
+	for (set<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+		filler(buf, it->c_str(), NULL, 0);
+	return 0;
+}
+
+/*********************************************************************/
+// Permissions.
+// readdir asks /sys/capabilities-self about every child in one POST and
+// keeps the answer as mode bits, so ls -l shows what the token may do and
+// tools can skip what they can't read.  Unqueried paths keep the defaults.
+
+struct PermEntry
+{
+	mode_t		file, dir;	// The bits for either shape; getattr picks.
+	chrono::steady_clock::time_point	expires;
+};
+
+static mutex permsLock;
+static map<string, PermEntry> perms;
+static bool usePerms = true;
+
+// One capabilities-self body for every serial in a big pki certs listing
+// costs more than the mode bits are worth.  Bigger listings keep defaults.
+static const size_t permsMax = 1000;
+
+// Collects names on their way to FUSE so readdir can follow up on them.
+struct DirFill
+{
+	void			*buf;
+	fuse_fill_dir_t	filler;
+	vector<string>	names;
+};
+
+int collectFill(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+	DirFill *df = (DirFill*) buf;
+
+	if (df->names.size() <= permsMax)
+		df->names.push_back(name);
+	return df->filler(df->buf, name, stbuf, off);
+}
+
+void permBits(const Json::Value &caps, PermEntry &entry)
+{
+	entry.file = entry.dir = 0;
+
+	for (Json::Value::ArrayIndex i = 0; i != caps.size(); ++i)
+	{
+		const string cap = caps[i].asString();
+
+		if (cap == "deny")
+		{
+			entry.file = entry.dir = 0;
+			return;
+		}
+		if (cap == "root" || cap == "sudo")
+		{
+			entry.file = 0600;
+			entry.dir = 0700;
+			return;
+		}
+
+		if (cap == "read")
+			entry.file |= 0400;
+		else if (cap == "list")
+			entry.dir |= 0500;
+		else if (cap == "create" || cap == "update" || cap == "delete")
+		{
+			entry.file |= 0200;
+			entry.dir |= 0200;
+		}
+	}
+}
+
+// Whether KV v2 metadata already told us path is a directory.
+bool knownDir(const string &path)
+{
+	lock_guard<mutex> lk(attrsLock);
+	map<string, SecretAttr>::const_iterator it = attrs.find(path);
+
+	return it != attrs.end() && it->second.isDir;
+}
+
+// One capabilities-self POST for every name listed in dir.
+void queryPerms(const string &dir, const vector<string> &names)
+{
+	MountTable::Ptr table = mounts();
+	const Mount *mount = table->find(dir);
+	vector<pair<string, string> > paths;	// (fs path, api path)
+	Json::StreamWriterBuilder builder;
+	Json::Value body, res;
+	string vdir, vname, version;
+
+	if (!usePerms || !mount || names.size() > permsMax)
+		return;
+
+	for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it)
+	{
+		const string path = dir + '/' + *it;
+		string api = path;
+
+		if (*it == "." || *it == "..")
+			continue;
+
+		// KV v2 policies are written against data/ and metadata/ paths.
+		if (mount->kvVersion == 2)
+		{
+			const string rel = path.substr(mount->path.length());
+			if (versionsPath(rel, vdir, vname, version) >= 0)
+				continue;
+			api = mount->path + (knownDir(path) ? "metadata/" + rel + '/' : "data/" + rel);
+		}
+
+		paths.push_back(make_pair(path, api));
+		body["paths"].append(api);
+	}
+
+	builder["indentation"] = "";
+	if (paths.empty() || vaultCURLjson(apiVers + "/sys/capabilities-self", res, "POST", Json::writeString(builder, body)))
+		return;
+
+	// Newer Vaults repeat the answer under data.
+	const Json::Value &caps = res["data"].isObject() ? res["data"] : res;
+	const chrono::steady_clock::time_point expires = chrono::steady_clock::now() + chrono::milliseconds(attrTtl);
+	lock_guard<mutex> lk(permsLock);
+
+	for (vector<pair<string, string> >::const_iterator it = paths.begin(); it != paths.end(); ++it)
+	{
+		if (!caps[it->second].isArray())
+			continue;
+
+		PermEntry &entry = perms[it->first];
+		permBits(caps[it->second], entry);
+		entry.expires = expires;
+	}
+}
+
+void applyPerms(const string &path, struct stat *stat)
+{
+	lock_guard<mutex> lk(permsLock);
+	map<string, PermEntry>::const_iterator it = perms.find(path);
+
+	if (it == perms.end() || chrono::steady_clock::now() >= it->second.expires)
+		return;
+
+	stat->st_mode = (stat->st_mode & S_IFMT) | (S_ISDIR(stat->st_mode) ? it->second.dir : it->second.file);
+}
+
+// <dir>/.export.tar, see ExportHandle.
+static const string exportName = ".export.tar";
+
+bool exportable(const Mount &mount)
+{
+	return mount.type == "kv" || mount.type == "generic" || mount.type == "cubbyhole";
+}
+
+// "secret/app/.export.tar" -> mount secret/, root "app/"
+const Mount *exportPath(const MountTable::Ptr &table, const string &p, string &root)
+{
+	const Mount *mount = table->find(p);
+	const string suffix = '/' + exportName;
+
+	if (!mount || !exportable(*mount) || p.length() < suffix.length()
+		|| p.compare(p.length() - suffix.length(), suffix.length(), suffix))
+		return NULL;
+
+	root = p.substr(0, p.length() - exportName.length());
+	root = root.length() > mount->path.length() ? root.substr(mount->path.length()) : "";
+	return mount;
+}
+
+int statPath(const char *path, struct stat *stat)
+{
+	const string p(path);
+	const size_t slashes = count(p.begin(), p.end(), '/');
+	int res = 0;
+	Json::Value json, dir;
+
+	stat->st_uid = getuid();
+	stat->st_gid = getgid();
+	stat->st_blocks = 
+	stat->st_blksize = 
+	stat->st_size = 0;
+
+	// Be careful with timestamp - file will always appear modified on disk.
+	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
+	//stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
+
+	// Due to crude and ambiguous attrs we can't determine secret or dir
+	// In fact, you can have both /path/secret and /path/secret/ which is ugly.
+	// FUSE automatically truncates trailing / during traversal.
+	// The only way to function is assume one layer deep (1 slash) is a dir, else file.
+	if (slashes <= 1)
+	{
+		stat->st_mode = S_IFDIR | 0700;	// Directory plus execute perm
+		return 0;
+	}
+
+	MountTable::Ptr table = mounts();
+	string root;
+	if (exportPath(table, p.substr(1), root))
+	{
+		stat->st_mode = S_IFREG | 0400;
+		return 0;
+	}
+
+	const Mount *mount = table->find(p.substr(1));
+	if (mount && mount->kvVersion == 2 && p.length() > mount->path.length())
+		return kv2Getattr(*mount, p.substr(1), stat);
+
+	string mountType = getMountType(p);
+	if (mountType == "")
+		return -ENOENT;
+
+	if (mountType == "kv")
+	{
+		if (slashes > 1)
+			stat->st_mode = S_IFREG | 0600;
+		else
+			stat->st_mode = S_IFDIR | 0700;
+	}
+	else if (regex_match(mountType, (regex)"(pki|ssh|transit|totp|aws|gcp|azure)"))
+	{
+		if (slashes > 2)
+			stat->st_mode = S_IFREG | 0600;
+		else
+			stat->st_mode = S_IFDIR | 0700;
+ 
+		return 0;
+	}
+	else if (mountType == "system")
+	{
+		if (regex_match(p, (regex)"(.*)/(leases|tools|namespaces|config|policy)"))
+			stat->st_mode = S_IFDIR | 0700;
+		else
+			stat->st_mode = S_IFREG | 0600;
+	}
+	else
+	{
+		stat->st_mode = S_IFREG | 0600;
+	}
+
+	return 0;
+}
+
+// Capabilities learnt by readdir override the default bits.
+int vault_getattr(const char *path, struct stat *stat)
+{
+	int res = statPath(path, stat);
+
+	if (!res)
+		applyPerms(path + 1, stat);
+	return res;
+}
+
+/*********************************************************************/
+// Credential pools.
+// Every read of a dynamic secret (aws/creds/<role>, database/creds/...)
+// mints a new credential, which can take seconds.  Paths listed in
+// VAULTFS_CREDPOOL keep a few credentials issued ahead of time: open()
+// takes one and a background thread tops the pool back up, renews leases
+// as they age and revokes whatever is left unused at unmount.
+
+struct PooledCred
+{
+	string		raw;			// As vaultFetch would return it.
+	string		leaseId;
+	bool		renewable;
+	chrono::steady_clock::time_point	renewAt, expires;
+};
+
+struct CredPool
+{
+	size_t		size, low;
+	deque<PooledCred>	ready;
+	chrono::steady_clock::time_point	retryAt;
+
+	CredPool() : size(0), low(0) {}
+};
+
+static mutex poolLock;
+static condition_variable poolWake;
+static map<string, CredPool> pools;
+static thread poolThread;
+static bool poolRunning = false;
+
+// Renew (or replace) once two thirds of the lease has gone.
+// No lease_duration means the credential doesn't expire.
+void leaseTimes(PooledCred &cred, long seconds)
+{
+	const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+	if (seconds <= 0)
+	{
+		cred.expires = cred.renewAt = chrono::steady_clock::time_point::max();
+		return;
+	}
+
+	cred.expires = now + chrono::seconds(seconds);
+	cred.renewAt = now + chrono::seconds(seconds * 2 / 3);
+}
+
+bool parseCredential(const string &body, PooledCred &cred)
+{
+	Json::Value data;
+	stringstream stream(body);
+
+	if (!(stream >> data) || !data.isObject())
+		return false;
+
+	cred.leaseId = data["lease_id"].asString();
+	cred.renewable = data["renewable"].asBool();
+	leaseTimes(cred, data["lease_duration"].asInt());
+
+	cred.raw = renderSecret(data);
+	return true;
+}
+
+hashifuse::HttpRequest leaseRequest(const string &op, const string &leaseId)
+{
+	Json::StreamWriterBuilder builder;
+	Json::Value body;
+
+	builder["indentation"] = "";
+	body["lease_id"] = leaseId;
+	return hashifuse::HttpRequest(apiVers + "/sys/leases/" + op, "POST", Json::writeString(builder, body));
+}
+
+// One pooled credential for path, if path is pooled and one is ready.
+bool takeCredential(const string &path, string &raw)
+{
+	lock_guard<mutex> lk(poolLock);
+	map<string, CredPool>::iterator it = pools.find(path);
+
+	if (it == pools.end())
+		return false;
+
+	// Whatever is taken is the caller's now, refill or not.
+	poolWake.notify_one();
+	while (!it->second.ready.empty())
+	{
+		PooledCred cred = it->second.ready.front();
+		it->second.ready.pop_front();
+
+		if (chrono::steady_clock::now() < cred.expires)
+		{
+			raw = cred.raw;
+			wipe(cred.raw);
+			return true;
+		}
+		wipe(cred.raw);
+	}
+
+	return false;
+}
+
+void poolLoop()
+{
+	typedef chrono::steady_clock Clock;
+	unique_lock<mutex> lk(poolLock);
+
+	while (poolRunning)
+	{
+		vector<hashifuse::HttpRequest> requests;
+		vector<pair<string, string> > work;	// (pool path, lease id).  Empty lease id means issue.
+		vector<string> revoke;
+		Clock::time_point now = Clock::now(), next = now + chrono::seconds(60);
+
+		for (map<string, CredPool>::iterator pool = pools.begin(); pool != pools.end(); ++pool)
+		{
+			deque<PooledCred> &ready = pool->second.ready;
+
+			for (deque<PooledCred>::iterator cred = ready.begin(); cred != ready.end(); )
+			{
+				if (now < cred->renewAt)
+				{
+					next = min(next, cred->renewAt);
+					++cred;
+					continue;
+				}
+
+				// Aged: renew it where we can, otherwise replace it.
+				if (cred->renewable && now < cred->expires)
+				{
+					work.push_back(make_pair(pool->first, cred->leaseId));
+					requests.push_back(leaseRequest("renew", cred->leaseId));
+					cred->renewAt = cred->expires;
+					++cred;
+					continue;
+				}
+
+				if (!cred->leaseId.empty())
+					revoke.push_back(cred->leaseId);
+				wipe(cred->raw);
+				cred = ready.erase(cred);
+			}
+
+			if (ready.size() < pool->second.low && now >= pool->second.retryAt)
+				for (size_t i = ready.size(); i < pool->second.size; ++i)
+				{
+					work.push_back(make_pair(pool->first, string()));
+					requests.push_back(vaultRequest(apiVers + '/' + pool->first));
+				}
+			else if (ready.size() < pool->second.low)
+				next = min(next, pool->second.retryAt);
+		}
+
+		for (vector<string>::iterator it = revoke.begin(); it != revoke.end(); ++it)
+			requests.push_back(leaseRequest("revoke", *it));
+
+		if (!requests.empty())
+		{
+			lk.unlock();
+			vector<hashifuse::HttpResponse> responses = vaultPerformAll(requests);
+			lk.lock();
+			now = Clock::now();
+
+			for (size_t i = 0; i < work.size(); ++i)
+			{
+				map<string, CredPool>::iterator pool = pools.find(work[i].first);
+				PooledCred cred;
+				Json::Value json;
+				stringstream body(responses[i].body);
+
+				if (work[i].second.empty())
+				{
+					if (responses[i].ok() && parseCredential(responses[i].body, cred))
+						pool->second.ready.push_back(cred);
+					else
+					{
+						*logs << RED << "Unable to fill credential pool " << work[i].first << " HTTP" << responses[i].code << RESET << endl;
+						pool->second.retryAt = now + chrono::seconds(5);
+					}
+					wipe(responses[i].body);
+					continue;
+				}
+
+				for (deque<PooledCred>::iterator c = pool->second.ready.begin(); c != pool->second.ready.end(); ++c)
+					if (c->leaseId == work[i].second)
+					{
+						// A refused renewal just runs the lease out, then it's replaced.
+						if (responses[i].ok() && (body >> json))
+							leaseTimes(*c, json["lease_duration"].asInt());
+						break;
+					}
+			}
+			continue;
+		}
+
+		poolWake.wait_until(lk, next);
+	}
+}
+
+// Revoke whatever nobody took.  Runs before the engine stops.
+void drainPools()
+{
+	vector<hashifuse::HttpRequest> requests;
+
+	{
+		lock_guard<mutex> lk(poolLock);
+		poolRunning = false;
+		poolWake.notify_all();
+	}
+	if (poolThread.joinable())
+		poolThread.join();
+
+	for (map<string, CredPool>::iterator pool = pools.begin(); pool != pools.end(); ++pool)
+	{
+		for (deque<PooledCred>::iterator cred = pool->second.ready.begin(); cred != pool->second.ready.end(); ++cred)
+		{
+			if (!cred->leaseId.empty())
+				requests.push_back(leaseRequest("revoke", cred->leaseId));
+			wipe(cred->raw);
+		}
+		pool->second.ready.clear();
+	}
+
+	vaultPerformAll(requests);
+}
+
+// Fetch the content of a path as it should appear in the file.
+int vaultFetch(string p, string &raw)
+{
+	const string key(p);
+	string mountType, dir, name, version;
+	Json::Value data;
+	stringstream stream;
+
+	// Need to get mount type to figure out how to read this path.
+	MountTable::Ptr table = mounts();
+	const Mount *mount = table->find(p);
+
+	if (!mount || p.length() < mount->path.length())
+		return -ENOENT;
+
+	mountType = mount->type;
+
+	if (mount->kvVersion == 2)
+		switch (versionsPath(p.substr(mount->path.length()), dir, name, version))
+		{
+		case -1:
+			break;
+		case 2:
+			return fetchVersion(*mount, key, dir.empty() ? name : dir + '/' + name, version, raw);
+		case 3:
+			return -ENOENT;
+		default:
+			return -EISDIR;
+		}
+
+	// Pooled dynamic credentials skip Vault and the cache.
+	if (takeCredential(key, raw))
+		return 0;
+
+	const bool useCache = p != "sys/mounts" && cacheable(*mount);
+	const bool useCerts = certCache.enabled() && cachedMount(*mount);
+	if (useCache && cachedSecret(*mount, key, raw))
+		return 0;
+
+	// Different ways to read kv versions.
+	if (mount->kvVersion == 2)
+		p.insert(mount->path.length(), "data/");
+
+	/*********************************************************************/
+	// Rewrite options:
+	bool cert = false;
+	if (mountType == "pki")
+	{
+		if (regex_match(p, (regex)"^(.*)/certs/(.*)$"))
+		{
+			// Annoyingly, list is /pki/certs, but read is /pki/cert/$serial
+			// We need to pick out that pesky 's'
+			size_t s = p.find("/certs/");
+			p.erase(s + 5, 1);
+
+			cert = !regex_match(p.substr(s + 6), (regex)"(ca|crl|delta-crl|ca_chain)");
+			if (cert && useCerts && certCache.get(key, raw))
+				return 0;
+		}
+		else if (regex_match(p, (regex)"^(.*)/ca/pem$"))
+		{
+			if (vaultCURL(apiVers + '/' + p, stream))
+				return -ENOENT;
+			raw = stream.str();
+			if (useCache)
+				contentCache.put(key, raw, 0, pkiTtl);
+			return 0;
+		}
+	}
 
-// CURL callback
-namespace
-{
-    std::size_t callback(
-            const char* in,
-            std::size_t size,
-            std::size_t num,
-            char* out)
-    {
-        string data(in, (size_t) size * num);
-        *((stringstream*) out) << data;
+	if (vaultCURLjson(apiVers + '/' + p, data))
+		return -ENOENT;
 
-        #if DEBUG
-		*logs << GREEN << data << RESET << endl;
-		#endif
-        return size * num;
-    }
+	// Allow manual refresh of mounts cache via reading /sys/mounts :)
+	if (p == "sys/mounts")
+		publishMounts(data);
+
+	long ttl = cacheTtlFor(*mount, data);
+	uint64_t current = 0;
+	if (mount->kvVersion == 2)
+		current = data["data"]["metadata"]["version"].asUInt64();
+	if (mountType == "pki" && pkiTtl > 0 && (ttl <= 0 || ttl > pkiTtl))
+		ttl = pkiTtl;
+
+	raw = renderSecret(data);
+	if (cert)
+	{
+		if (useCerts)
+			certCache.put(key, raw, 0, 0);
+	}
+	else if (useCache)
+		contentCache.put(key, raw, current, ttl);
+	return 0;
 }
 
-// Vault GET raw via libcurl
-// Currently supports request GET (default), POST, LIST.
-// TODO: escape environment variables for injection vulnerabilities.
-int	vaultCURL(string url, stringstream &httpData, string request = "GET", const string post = "")
+/*********************************************************************/
+// Transit pipelines.
+// transit/encrypt/<key> and transit/decrypt/<key> take newline separated
+// plaintexts (or ciphertexts).  Complete lines go out as batch_input
+// requests as soon as a batch fills, with several batches in flight, and
+// the results come back one per line in the order they were written.
+// Read them from the same handle, or reopen the file after close.
+
+struct TransitHandle : hashifuse::FileHandle
+{
+	typedef pair<future<hashifuse::HttpResponse>, size_t> Batch;
+
+	mutex lock;
+	string path, url;
+	bool encrypt, wrote;
+	int error;
+	string partial;					// Trailing bytes without a newline yet.
+	vector<string> batch;
+	deque<Batch> inflight;			// Oldest first, so results stay in order.
+
+	TransitHandle() : encrypt(true), wrote(false), error(0) {}
+	~TransitHandle() { wipe(data); wipe(partial); }
+};
+
+static size_t transitBatch = 250;
+static size_t transitInflight = 4;
+
+// Results of the last stream written to each transit file, for reopening
+// after close.  Decrypt results are plaintext, so they're zeroized and only
+// kept for transitTtl.  Results over a quarter of the cache are only
+// readable from the handle that wrote them.
+static hashifuse::ContentCache transitResults(0);
+static long transitTtl = 60000;
+
+// "transit/encrypt/<key>" -> true, with encrypt set.
+bool transitPath(const string &p, bool &encrypt)
 {
-	int res = 0, httpCode = 0;
-	string tokenHeader = "X-Vault-Token: ";
-	string nsHeader = "X-Vault-Namespace: ";
-	struct curl_slist *headers = curl_slist_append(NULL, (tokenHeader + getenv("VAULT_TOKEN")).c_str());
-	CURL* curl;
+	MountTable::Ptr table = mounts();
+	const Mount *mount = table->find(p);
 
-	if (getenv("VAULT_NAMESPACE"))
-		headers = curl_slist_append(headers, (nsHeader + getenv("VAULT_NAMESPACE")).c_str());
+	if (!mount || mount->type != "transit")
+		return false;
 
-	url = (string)getenv("VAULT_ADDR") + url;
+	const string rel = p.substr(mount->path.length());
+	const size_t slash = rel.find('/');
+	if (slash == string::npos || slash + 1 == rel.length() || rel.find('/', slash + 1) != string::npos)
+		return false;
 
-	#if DEBUG
-	*logs << CYAN << url << RESET << endl;
-	#endif
+	const string op = rel.substr(0, slash);
+	encrypt = op == "encrypt";
+	return encrypt || op == "decrypt";
+}
 
-	{
-		lock_guard<mutex> lk(curlmutex);
-	
-		if (!(curl = curl_easy_init()))
-			return -1;
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
-			return res;
+// Wait for the oldest batch and append its results.
+void transitCollect(TransitHandle *th)
+{
+	TransitHandle::Batch batch = std::move(th->inflight.front());
+	hashifuse::HttpResponse res;
+	Json::Value json;
+	stringstream body;
 
-		if (res = curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.c_str()))
-			return res;
+	th->inflight.pop_front();
+	res = batch.first.get();
+	body << res.body;
 
-		if (request == "POST" && post != "")
-		{
-			if (res = curl_easy_setopt(curl, CURLOPT_POST, 1))
-				return res;
+	if (!res.ok() || !(body >> json) || json["data"]["batch_results"].size() != batch.second)
+	{
+		*logs << RED << "Transit batch failed -> " << th->url << " HTTP" << res.code << RESET << endl;
+		th->error = -EIO;
+		return;
+	}
 
-			if (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.c_str()))
-				return res;
-	 	}
-		
-		if (res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
-			return res;
+	const Json::Value &results = json["data"]["batch_results"];
+	for (Json::Value::ArrayIndex i = 0; i != results.size(); ++i)
+	{
+		if (results[i].isMember("error") && !results[i]["error"].asString().empty())
+		{
+			*logs << RED << "Transit " << th->url << " item " << i << ": " << results[i]["error"].asString() << RESET << endl;
+			th->error = -EIO;
+			continue;
+		}
 
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &httpData);
+		if (th->encrypt)
+			th->data += results[i]["ciphertext"].asString();
+		else
+			th->data += hashifuse::base64Decode(results[i]["plaintext"].asString());
+		th->data += '\n';
+	}
+}
 
-		// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
-		if (access("~/vaultfs.pem", F_OK) != -1)
-			curl_easy_setopt(curl, CURLOPT_CAINFO, "~/vaultfs.pem");
+// Send the current batch, first making room if too many are in flight.
+void transitSend(TransitHandle *th)
+{
+	Json::StreamWriterBuilder builder;
+	Json::Value body;
+	Json::Value &input = body["batch_input"];
 
-		#if DEBUG
-		if (post != "")
-			*logs << YELLOW << post << RESET << endl;
-		#endif 
+	if (th->batch.empty())
+		return;
 
-		curl_easy_perform(curl);
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(headers);
-	}
+	while (th->inflight.size() >= transitInflight)
+		transitCollect(th);
 
-	if (httpCode < 200 || httpCode >= 300)
+	builder["indentation"] = "";
+	input = Json::Value(Json::arrayValue);
+	for (vector<string>::iterator it = th->batch.begin(); it != th->batch.end(); ++it)
 	{
-		*logs << "Couldn't " << request << " " << post << " -> " << url << " HTTP" << httpCode << endl;
-		return httpCode;
+		Json::Value item;
+		if (th->encrypt)
+			item["plaintext"] = hashifuse::base64Encode(*it);
+		else
+			item["ciphertext"] = *it;
+		input.append(item);
+		wipe(*it);
 	}
 
-	return res;
+	th->inflight.push_back(TransitHandle::Batch(
+		engine.submit(hashifuse::HttpRequest(th->url, "POST", Json::writeString(builder, body))), th->batch.size()));
+	th->batch.clear();
 }
 
-int	vaultCURLjson(string url, Json::Value &jsonData, string request = "GET", string post = "")
+int transitWrite(TransitHandle *th, const char *buf, size_t size)
 {
-	stringstream stream;
-	Json::CharReaderBuilder jsonReader;
-	int	res = 0;
+	lock_guard<mutex> lk(th->lock);
+	size_t start = 0, nl;
 
-	if (res = vaultCURL(url, stream, request, post))
-		return res;
+	if (th->error)
+		return th->error;
 
-	stream >> jsonData;
+	th->wrote = true;
+	th->partial.append(buf, size);
+	while ((nl = th->partial.find('\n', start)) != string::npos)
+	{
+		th->batch.push_back(th->partial.substr(start, nl - start));
+		start = nl + 1;
+		if (th->batch.size() >= transitBatch)
+			transitSend(th);
+	}
+	th->partial.erase(0, start);
 
-	return 0;
+	return th->error ? th->error : size;
 }
 
-// Cache /sys/mounts for speed.
-int cacheMounts()
+// Drain the pipeline and publish results for later readers.
+int transitFlush(TransitHandle *th)
 {
-	Json::Value mounts;
-	vector<string> removers;
-	if (vaultCURLjson(apiVers + "/sys/mounts", gMounts))
-		return -EINVAL;
-	
-	for (Json::Value::const_iterator it = gMounts.begin(); it != gMounts.end(); ++it)
-		if (!(it->isObject() && it->isMember("type")))
-			removers.push_back(it.key().asString());
-	
-	// Clear out garbage members that aren't actually mounts with type.
-	for (vector<string>::iterator rm = removers.begin(); rm != removers.end(); ++rm)
-		gMounts.removeMember(*rm);
-	
+	lock_guard<mutex> lk(th->lock);
+
+	if (!th->wrote)
+		return th->error;
+
+	if (!th->partial.empty())
+	{
+		th->batch.push_back(th->partial);
+		wipe(th->partial);
+	}
+	transitSend(th);
+	while (!th->inflight.empty())
+		transitCollect(th);
+
+	if (th->error)
+		return th->error;
+
+	transitResults.put(th->path, th->data);
 	return 0;
 }
 
-string getMountType(string path)
+int transitOpen(const string &p, bool encrypt, struct fuse_file_info *fi)
 {
-	size_t pos;
+	// Results have no size in getattr, so skip the page cache.
+	fi->direct_io = 1;
 
-	if (path[0] == '/')
-		path = path.substr(1);
-
-	if ((pos = path.find('/')) != string::npos)
-		path = path.substr(0, pos + 1);
+	if ((fi->flags & O_ACCMODE) == O_RDONLY)
+	{
+		hashifuse::FileHandle *fh = new hashifuse::FileHandle();
 
-	if (gMounts.isMember(path))
-		return gMounts[path]["type"].asString();
+		transitResults.get(p, fh->data);
+		hashifuse::setHandle(fi, fh);
+		return 0;
+	}
 
-	return "";
+	TransitHandle *th = new TransitHandle();
+	th->path = p;
+	th->url = apiVers + '/' + p;
+	th->encrypt = encrypt;
+	hashifuse::setHandle(fi, th);
+	return 0;
 }
 
-int vault_getattr(const char *path, struct stat *stat)
-{
-	const string p(path);
-	const size_t slashes = count(p.begin(), p.end(), '/');
-	int res = 0;
-	Json::Value json, dir;
-
-	stat->st_uid = getuid();
-	stat->st_gid = getgid();
-	stat->st_blocks = 
-	stat->st_blksize = 
-	stat->st_size = 0;
+/*********************************************************************/
+// Subtree export.
+// Reading <dir>/.export.tar on a KV mount walks everything below dir and
+// streams it out as a tar.  The walk is driven by the reader: each read
+// that runs past what's been archived so far tops up to exportInflight
+// LIST/GET requests through the engine and archives the oldest answer,
+// so data flows long before the walk ends.  Not listed, so cp -r and
+// rsync don't recurse into it.
 
-	// Be careful with timestamp - file will always appear modified on disk.
-	stat->st_atime = stat->st_mtime = stat->st_ctime = time(NULL);
-	//stat->st_atime = stat->st_mtime = stat->st_ctime = 0;
+static size_t exportInflight = 32;
 
-	// Due to crude and ambiguous attrs we can't determine secret or dir
-	// In fact, you can have both /path/secret and /path/secret/ which is ugly.
-	// FUSE automatically truncates trailing / during traversal.
-	// The only way to function is assume one layer deep (1 slash) is a dir, else file.
-	if (slashes <= 1)
+struct ExportHandle : hashifuse::FileHandle
+{
+	struct Pending
 	{
-		stat->st_mode = S_IFDIR | 0700;	// Directory plus execute perm
-		return 0;
-	}
+		hashifuse::HttpRequest	request;
+		future<hashifuse::HttpResponse>	response;
+		string	key;		// Relative to root.  Dirs end with '/'.
+	};
 
-	string mountType = getMountType(p);
-	if (mountType == "")
-		return -ENOENT;
+	mutex lock;
+	Mount mount;
+	string root;			// Exported dir below the mount, "" or "app/".
+	deque<string> dirs, secrets;
+	deque<Pending> inflight;
+	off_t base;				// File offset of data[0]; what's been read is dropped.
+	bool done;
+	int error;				// Sticky, so a partial walk never ends like a whole one.
+
+	ExportHandle() : base(0), done(false), error(0) {}
+	~ExportHandle() { wipe(data); }
+};
+
+// Archive the oldest answer.  False once the walk is complete or has failed.
+bool exportStep(ExportHandle *eh)
+{
+	const string api = apiVers + '/' + eh->mount.path;
 
-	// Get capabilities for this path.
-	// example payload: {"paths": ["secret/foo"]}
-	//	const string post = (string)"{\"paths\": [\"" + path + "\"]}";
-	//	if (res = vaultCURLjson(apiVers + "/sys/capabilities-self", json, "POST", post))
-	//		return -EINVAL;
-	if (mountType == "kv")
+	while (eh->inflight.size() < exportInflight && !(eh->secrets.empty() && eh->dirs.empty()))
 	{
-		if (slashes > 1)
-			stat->st_mode = S_IFREG | 0600;
+		// Secrets first keeps the queues short.
+		const bool list = eh->secrets.empty();
+		deque<string> &queue = list ? eh->dirs : eh->secrets;
+		ExportHandle::Pending pending;
+
+		pending.key = queue.front();
+		queue.pop_front();
+
+		if (eh->mount.kvVersion == 2)
+			pending.request = vaultRequest(api + (list ? "metadata/" : "data/") + eh->root + pending.key, list ? "LIST" : "GET");
 		else
-			stat->st_mode = S_IFDIR | 0700;
+			pending.request = vaultRequest(api + eh->root + pending.key, list ? "LIST" : "GET");
+		pending.response = engine.submit(pending.request);
+		eh->inflight.push_back(std::move(pending));
 	}
-	else if (regex_match(mountType, (regex)"(pki|ssh|transit|totp|aws|gcp|azure)"))
+
+	if (eh->inflight.empty())
+		return false;
+
+	ExportHandle::Pending pending = std::move(eh->inflight.front());
+	hashifuse::HttpResponse res = pending.response.get();
+	Json::Value json;
+
+	eh->inflight.pop_front();
+	if (toActive(pending.request, res))
+		engine.perform(pending.request, res);
+
+	stringstream body(res.body);
+	wipe(res.body);
+
+	// 404 on a LIST is just an empty dir.  Secrets we may not read are left
+	// out.  Anything else would leave a hole, so the export fails instead.
+	if (res.code == 404 || res.code == 403)
 	{
-		if (slashes > 2)
-			stat->st_mode = S_IFREG | 0600;
-		else
-			stat->st_mode = S_IFDIR | 0700;
- 
-		return 0;
+		if (res.code == 403)
+			*logs << YELLOW << "Export skipping " << eh->mount.path << eh->root << pending.key << " HTTP" << res.code << RESET << endl;
+		return true;
 	}
-	else if (mountType == "system")
+	if (!res.ok() || !(body >> json))
 	{
-		if (regex_match(p, (regex)"(.*)/(leases|tools|namespaces|config|policy)"))
-			stat->st_mode = S_IFDIR | 0700;
-		else
-			stat->st_mode = S_IFREG | 0600;
+		*logs << RED << "Export failed at " << eh->mount.path << eh->root << pending.key << " HTTP" << res.code << RESET << endl;
+		eh->error = -EIO;
+		return false;
 	}
-	else
+
+	if (pending.key.empty() || pending.key[pending.key.length() - 1] == '/')
 	{
-		stat->st_mode = S_IFREG | 0600;
+		const Json::Value &keys = json["data"]["keys"];
+		for (Json::Value::ArrayIndex i = 0; i != keys.size(); ++i)
+		{
+			const string k = pending.key + keys[i].asString();
+			(k[k.length() - 1] == '/' ? eh->dirs : eh->secrets).push_back(k);
+		}
+		return true;
 	}
 
-	// Isolate the single dir/mount we need.
-	//TODO - this is phantom creation....
-	//dir = gMounts[p];
-	/*
-	for (Json::Value::ArrayIndex i = 0; i != dir.size(); ++i)
-	{
-		if (!dir[i].isString())
-			continue;
-		
-		string cap = dir[i].asString();
+	// Const lookups: operator[] on a mutable Value would add the members.
+	const Json::Value &entry = json;
+	time_t mtime = parseTime(entry["data"]["metadata"]["created_time"].asString());
+	string content = renderSecret(json);
 
-		if (cap == "root" || cap == "sudo")
-			stat->st_mode |= 0600;
-		else if (cap == "read")
-			stat->st_mode |= 0400;
-		else if (cap == "write")
-			stat->st_mode |= 0200;
-		else if (cap == "list")
-			stat->st_mode |= S_IFDIR | 0100;
-	}
-	*/
-	return 0;
+	hashifuse::tarFile(eh->data, pending.key, content, mtime ? mtime : time(NULL), 0600);
+	wipe(content);
+	return true;
 }
 
-int vault_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+int exportRead(ExportHandle *eh, char *buf, size_t size, off_t offset)
 {
-	static string raw;
-	string p(path + 1), mountType;
-	Json::Value mount, data;
-	Json::StreamWriterBuilder builder;
-	stringstream stream;
-	int res, len;
-	size_t mlen;
+	lock_guard<mutex> lk(eh->lock);
 
-	if (offset > 0)
-		return 0;
-	
-	// Allow manual refresh of mounts cache via reading /sys/mounts :)
-	if (p == "/sys/mounts")
-		cacheMounts();
+	// Streamed, so only forward.  Drop what's behind the reader.
+	if (offset < eh->base)
+		return -ESPIPE;
+	if ((size_t) (offset - eh->base) >= (1 << 20))
+	{
+		fill(eh->data.begin(), eh->data.begin() + (offset - eh->base), '\0');
+		eh->data.erase(0, offset - eh->base);
+		eh->base = offset;
+	}
 
-	// Need to get mount type to figure out how to read this path.
-	if (res = vaultCURLjson(apiVers + "/sys/mounts", mount))
-		return -EINVAL;
+	while (!eh->done && !eh->error && eh->base + (off_t) eh->data.size() < offset + (off_t) size)
+		if (!exportStep(eh) && !eh->error)
+		{
+			hashifuse::tarEnd(eh->data);
+			eh->done = true;
+		}
+	if (eh->error)
+		return eh->error;
 
-	if ((mlen = p.find('/')) == string::npos)
-		return -ENOENT;
-	
-	// Need to get the first level of path for mount details.
-	string mpath = p.substr(0, mlen + 1);
-	if (mount.isMember(mpath))
-			mount = mount[mpath];
-		else
-			return -ENOENT;
+	return hashifuse::readBuffer(eh->data, buf, size, offset - eh->base);
+}
+
+// Read once at open into a per-handle buffer; no more double reads.
+int vault_open(const char *path, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh;
+	bool encrypt;
+	int res;
 
-	mountType = mount["type"].asString();
+	if (transitPath(path + 1, encrypt))
+		return transitOpen(path + 1, encrypt, fi);
 
-	// Different ways to read kv versions.
-	if (mountType == "kv")
+	MountTable::Ptr table = mounts();
+	string root;
+	if (const Mount *mount = exportPath(table, path + 1, root))
 	{
-		if (!mount["options"].isNull() && mount["options"]["version"].isString())
+		ExportHandle *eh = new ExportHandle();
+
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
 		{
-			if (mount["options"]["version"].asString() == "2")
-				p.insert(mpath.length(), "data/");
+			delete eh;
+			return -EACCES;
 		}
+
+		eh->mount = *mount;
+		eh->root = root;
+		eh->dirs.push_back("");
+		fi->direct_io = 1;
+		fi->nonseekable = 1;
+		hashifuse::setHandle(fi, eh);
+		return 0;
 	}
 
-	/*********************************************************************/
-	// Rewrite options:
-	if (mountType == "pki")
+	fh = new hashifuse::FileHandle();
+
+	if ((fi->flags & O_ACCMODE) != O_WRONLY && (res = vaultFetch(path + 1, fh->data)))
 	{
-		if (regex_match(p, (regex)"^(.*)/certs/(.*)$"))
-		{
-			// Annoyingly, list is /pki/certs, but read is /pki/cert/$serial
-			// We need to pick out that pesky 's'
-			size_t s = p.find("/certs/");
-			p.erase(s + 5, 1);
-		}
-		else if (regex_match(p, (regex)"^(.*)/ca/pem$"))
-		{
-			if (res = vaultCURL(apiVers + '/' + p, stream))
-				return -ENOENT;
-			raw = stream.str();
-		}
+		delete fh;
+		return res;
 	}
-	else
-	{
-		if (res = vaultCURLjson(apiVers + '/' + p, data))
-			return -ENOENT;
-		
-		// Because some secret engines have ".data.data"...
-		// Beware someone actually calling a secret "data"
-		while (data.isObject() && data.isMember("data"))
-			data = data["data"];
 
-		raw = Json::writeString(builder, data);
+	hashifuse::setHandle(fi, fh);
+	return 0;
+}
+
+int vault_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh = hashifuse::getHandle(fi);
+	TransitHandle *th = dynamic_cast<TransitHandle*>(fh);
+	ExportHandle *eh = dynamic_cast<ExportHandle*>(fh);
+
+	if (!fh)
+		return -EBADF;
+	if (eh)
+		return exportRead(eh, buf, size, offset);
+	if (th)
+	{
+		lock_guard<mutex> lk(th->lock);
+		return hashifuse::readBuffer(th->data, buf, size, offset);
 	}
+	return hashifuse::readBuffer(fh->data, buf, size, offset);
+}
 
-	len = min(size, raw.length());
+// Only transit streams have anything left to send at close.
+int vault_flush(const char *path, struct fuse_file_info *fi)
+{
+	TransitHandle *th = dynamic_cast<TransitHandle*>(hashifuse::getHandle(fi));
 
-	// We've reached the end of the file? (DIRECT_IO)
-	// Unfortunately this usually means double reads :/
-	if (offset >= len)
-		return 0;
-	
-	strncpy(buf + offset, raw.c_str(), len);
-	return len;
+	return th ? transitFlush(th) : 0;
+}
+
+int vault_release(const char *path, struct fuse_file_info *fi)
+{
+	hashifuse::FileHandle *fh = hashifuse::getHandle(fi);
+
+	// Secrets and transit results alike.
+	if (fh)
+		wipe(fh->data);
+	hashifuse::freeHandle(fi);
+	return 0;
 }
 
 int vault_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -383,6 +1686,10 @@ int vault_write(const char *path, const char *buf, size_t size, off_t offset, st
 	Json::StreamWriterBuilder builder;
 	stringstream stream;
 	size_t mlen;
+	TransitHandle *th = dynamic_cast<TransitHandle*>(hashifuse::getHandle(fi));
+
+	if (th)
+		return transitWrite(th, buf, size);
 
 	// Need to get mount type to figure out how to read this path.
 	//if (res = vaultCURLjson("/v1/sys/mounts", mount))
@@ -395,6 +1702,11 @@ int vault_write(const char *path, const char *buf, size_t size, off_t offset, st
 	//payload = "{\"data\":" + payload + "}";
 	//p.insert(mlen, "/data");
 
+	contentCache.erase(p);
+	{
+		lock_guard<mutex> lk(attrsLock);
+		attrs.erase(p);
+	}
 	if (vaultCURL(apiVers + '/' + p, stream, "POST", payload.c_str()))
 		return -EINVAL;
 
@@ -448,55 +1760,37 @@ void fillMembers(Json::Value &root, void *buf, fuse_fill_dir_t filler)
 // Readdir manually builds out dir structure based on /sys/mounts
 // Note that as we're DIRECT_IO and don't necessarily know what's out there,
 // we can't use READDIR_PLUS sadly.  I started to implement this in FUSE3 but had issues.
-int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+int listPath(const char *path, void *buf, fuse_fill_dir_t filler)
 {
-	Json::Value mount, keys;
+	Json::Value keys;
 	string p(path), smount, mountType;
+	MountTable::Ptr table = mounts();
 	int res = 0;
 	
 	// Root?
 	if (p == "/")
 	{	
-		vector<string> members = gMounts.getMemberNames();
+		vector<string> members = table->names();
 		for(vector<string>::iterator iter = members.begin(); iter != members.end(); ++iter)
-		{
-			// Remove trailing /
-			if (iter->find('/') == iter->length() - 1)
-				iter->pop_back();
 			filler(buf, iter->c_str(), NULL, 0);
-		}
 		return 0;
 	}
 
 	p = p.substr(1) + '/';
-	smount = p.substr(0, p.find('/')) + '/';
 
 	// Isolate the single mount we need.
-	if (gMounts.isMember(smount))
-		mount = gMounts[smount];
-	else
+	const Mount *mount = table->find(p.substr(0, p.length() - 1));
+	if (!mount)
 		return -ENOENT;
-	
-	mountType = mount["type"].asString();
 
-	// KV version 1 is indicated by options=NULL 
-	// whereas version 2, options="version=2"
+	smount = mount->path;
+	mountType = mount->type;
+
 	if (mountType == "kv")
 	{
-		if (!mount["options"].isNull() && mount["options"]["version"].isString())
-		{
-			// Really just keep going and try to read using v2 style...
-			// May need to add v2, v3, etc. later
-			string vers = mount["options"]["version"].asString();
-			p = p.substr(0, p.length() - 1);
-			string secdir = p.substr(smount.length() - 1);
-
-			if (vers == "2")
-			{
-				if (res = vaultCURLjson(apiVers + '/' + smount + "metadata/" + secdir, keys, "LIST"))
-					return -ENOENT;
-			}
-		}
+		// May need to add v3, etc. later
+		if (mount->kvVersion == 2)
+			return kv2Readdir(*mount, p.substr(0, p.length() - 1), buf, filler);
 	}
 	else if (regex_match(mountType, (regex)"(pki|ssh)"))
 	{
@@ -512,9 +1806,13 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 			filler(buf, "ca", NULL, 0);
 			filler(buf, "crl", NULL, 0);
 			filler(buf, "ca_chain", NULL, 0);
-			if (res = vaultCURLjson(apiVers + '/' + smount + "/certs", keys, "LIST"))
+
+			// Can be hundreds of thousands of serials, so no Json DOM here.
+			if (res = vaultListStream(apiVers + '/' + smount + "certs", [&](const string &serial)
+				{
+					filler(buf, serial.c_str(), NULL, 0);
+				}))
 				return -ENOENT;
-			fillArray(keys["data"]["keys"], buf, filler);
 		}
 		else if (p == smount + "roles/")
 		{
@@ -533,8 +1831,18 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 		{
 			filler(buf, "keys", NULL, 0);
 			filler(buf, "random", NULL, 0);
+			if (mountType == "transit")
+			{
+				filler(buf, "encrypt", NULL, 0);
+				filler(buf, "decrypt", NULL, 0);
+			}
 			return 0;
 		}
+		else if (mountType == "transit" && (p == smount + "encrypt/" || p == smount + "decrypt/"))
+		{
+			if (res = vaultCURLjson(apiVers + '/' + smount + "keys", keys, "LIST"))
+				return -ENOENT;
+		}
 		//else if (p == smount + "keys/") // fallback to default handler.
 		// TODO browse versions.
 	}
@@ -591,16 +1899,146 @@ int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 	return 0;
 }
 
+int vault_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	DirFill df;
+	int res;
+
+	df.buf = buf;
+	df.filler = filler;
+	if ((res = listPath(path, &df, collectFill)) || !strcmp(path, "/"))
+		return res;
+
+	queryPerms(path + 1, df.names);
+	return 0;
+}
+
 void* vault_init(struct fuse_conn_info *conn)
 {
+	vector<string> headers;
+
 	curl_global_init(CURL_GLOBAL_ALL);
 	conn->want |= FUSE_CAP_BIG_WRITES;
 
+	// TODO: escape environment variables for injection vulnerabilities.
+	if (getenv("VAULT_TOKEN"))
+		headers.push_back((string)"X-Vault-Token: " + getenv("VAULT_TOKEN"));
+	if (getenv("VAULT_NAMESPACE"))
+		headers.push_back((string)"X-Vault-Namespace: " + getenv("VAULT_NAMESPACE"));
+
+	http.configure(getenv("VAULT_ADDR") ? getenv("VAULT_ADDR") : "http://localhost:8200", headers, 5);
+
+	if (getenv("VAULTFS_READ_ADDRS"))
+	{
+		stringstream addrs(getenv("VAULTFS_READ_ADDRS"));
+		string addr;
+
+		while (getline(addrs, addr, ','))
+		{
+			while (!addr.empty() && addr[addr.length() - 1] == '/')
+				addr.pop_back();
+			if (!addr.empty())
+				readAddrs.push_back(addr);
+		}
+	}
+
+	if (getenv("VAULTFS_MOUNTS_TTL"))
+		mountsTtl = atol(getenv("VAULTFS_MOUNTS_TTL"));
+	if (getenv("VAULTFS_CACHE_SIZE"))
+		cacheSize = strtoull(getenv("VAULTFS_CACHE_SIZE"), NULL, 10);
+	if (getenv("VAULTFS_CACHE_TTL"))
+		cacheTtl = atol(getenv("VAULTFS_CACHE_TTL"));
+	if (getenv("VAULTFS_CERT_CACHE_SIZE"))
+		certCacheSize = strtoull(getenv("VAULTFS_CERT_CACHE_SIZE"), NULL, 10);
+	if (getenv("VAULTFS_PKI_TTL"))
+		pkiTtl = atol(getenv("VAULTFS_PKI_TTL"));
+	if (getenv("VAULTFS_ATTR_TTL"))
+		attrTtl = atol(getenv("VAULTFS_ATTR_TTL"));
+	if (getenv("VAULTFS_EXPORT_INFLIGHT") && atol(getenv("VAULTFS_EXPORT_INFLIGHT")) > 0)
+		exportInflight = atol(getenv("VAULTFS_EXPORT_INFLIGHT"));
+	usePerms = !(getenv("VAULTFS_PERMS") && (string)getenv("VAULTFS_PERMS") == "false");
+	if (getenv("VAULTFS_TRANSIT_BATCH") && atol(getenv("VAULTFS_TRANSIT_BATCH")) > 0)
+		transitBatch = atol(getenv("VAULTFS_TRANSIT_BATCH"));
+	if (getenv("VAULTFS_TRANSIT_INFLIGHT") && atol(getenv("VAULTFS_TRANSIT_INFLIGHT")) > 0)
+		transitInflight = atol(getenv("VAULTFS_TRANSIT_INFLIGHT"));
+	if (getenv("VAULTFS_TRANSIT_TTL") && atol(getenv("VAULTFS_TRANSIT_TTL")) > 0)
+		transitTtl = atol(getenv("VAULTFS_TRANSIT_TTL"));
+	if (getenv("VAULTFS_CREDPOOL"))
+	{
+		stringstream specs(getenv("VAULTFS_CREDPOOL"));
+		string spec;
+
+		// "aws/creds/deploy=4,database/creds/ro=2:1"
+		while (getline(specs, spec, ','))
+		{
+			size_t eq = spec.find('=');
+			char *end;
+			if (eq == string::npos || eq == 0)
+				continue;
+
+			string poolPath = spec.substr(spec[0] == '/' ? 1 : 0, eq - (spec[0] == '/' ? 1 : 0));
+			size_t size = strtoul(spec.c_str() + eq + 1, &end, 10);
+			if (!size)
+				continue;
+
+			CredPool &pool = pools[poolPath];
+			pool.size = size;
+			pool.low = *end == ':' ? strtoul(end + 1, NULL, 10) : (size + 1) / 2;
+			pool.low = min(max(pool.low, (size_t) 1), size);
+		}
+	}
+	if (getenv("VAULTFS_CACHE_MOUNTS"))
+	{
+		stringstream rules(getenv("VAULTFS_CACHE_MOUNTS"));
+		string rule;
+
+		// "secret/=off,aws/=on"
+		while (getline(rules, rule, ','))
+		{
+			size_t eq = rule.find('=');
+			if (eq == string::npos || eq == 0)
+				continue;
+
+			string mount = rule.substr(0, eq);
+			if (mount[mount.length() - 1] != '/')
+				mount += '/';
+			cachePolicy[mount] = rule.substr(eq + 1) == "on";
+		}
+	}
+	contentCache.configure(cacheSize, cacheTtl, true);
+	certCache.configure(certCacheSize, 0);
+	transitResults.configure(64 << 20, transitTtl, true);
+
+	// Optional setting CA bundle... not ideal but libcurl doesn't use env variables.
+	if (access("~/vaultfs.pem", F_OK) != -1)
+		http.setCA("~/vaultfs.pem");
+
 	cacheMounts();
 
+	if (!engine.start())
+		*logs << RED << "Unable to start async engine, requests will block" << RESET << endl;
+
+	if (!pools.empty())
+	{
+		poolRunning = true;
+		poolThread = thread(poolLoop);
+	}
+
 	return NULL;
 }
 
+// Free up curl resources.
+void vault_destroy(void* private_data)
+{
+	drainPools();
+	engine.stop();
+	contentCache.clear();
+	certCache.clear();
+	transitResults.clear();
+	http.close();
+	curl_global_cleanup();
+}
+
 // Need to implement this for truncate/write.
 int vault_truncate(const char *path, off_t newsize)
 {
@@ -615,11 +2053,15 @@ int main(int argc, char *argv[])
 	{
 		.getattr = vault_getattr,
 		.truncate = vault_truncate,
+		.open = vault_open,
 		.read = vault_read,
 		.write = vault_write,
 		.statfs = vault_statfs,
+		.flush = vault_flush,
+		.release = vault_release,
 		.readdir = vault_readdir,
 		.init = vault_init,
+		.destroy = vault_destroy,
 	};
 
 	if ((getuid() == 0) || (geteuid() == 0))
@@ -0,0 +1,294 @@
+/****************************************************************************
+**
+** libhashifuse - asynchronous request engine.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include <iostream>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "HashiAsync.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	HttpEngine::HttpEngine(HttpClient &client)
+		: client(client), multi(NULL), epfd(-1), evfd(-1), timerSet(false), running(false), stopped(false)
+	{
+	}
+
+	HttpEngine::~HttpEngine()
+	{
+		stop();
+	}
+
+	bool HttpEngine::start(long maxConnections)
+	{
+		struct epoll_event ev;
+
+		if (running)
+			return true;
+		stopped = false;
+
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			return false;
+
+		// Submitters poke the eventfd to wake the loop.
+		if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		{
+			close(epfd);
+			return false;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.fd = evfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+
+		multi = curl_multi_init();
+		curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socketCallback);
+		curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+		curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timerCallback);
+		curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+		if (maxConnections)
+			curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, maxConnections);
+
+		running = true;
+		thread = std::thread(&HttpEngine::loop, this);
+		return true;
+	}
+
+	void HttpEngine::stop()
+	{
+		uint64_t one = 1;
+
+		{
+			lock_guard<mutex> lk(queueLock);
+			stopped = true;
+			if (!running)
+				return;
+			running = false;
+		}
+
+		if (write(evfd, &one, sizeof(one)) < 0)
+			*logs << "HttpEngine: unable to wake event loop" << endl;
+		thread.join();
+
+		// Fail whatever was still pending rather than leaving waiters hung.
+		for (set<Job*>::iterator it = active.begin(); it != active.end(); ++it)
+		{
+			curl_multi_remove_handle(multi, (*it)->curl);
+			abort(*it);
+		}
+		active.clear();
+
+		for (deque<Job*>::iterator it = queue.begin(); it != queue.end(); ++it)
+			abort(*it);
+		queue.clear();
+
+		curl_multi_cleanup(multi);
+		close(evfd);
+		close(epfd);
+		multi = NULL;
+		evfd = epfd = -1;
+	}
+
+	void HttpEngine::abort(Job *job)
+	{
+		if (job->curl)
+			client.finish(*job);
+		job->response.result = CURLE_ABORTED_BY_CALLBACK;
+		job->promise.set_value(std::move(job->response));
+		delete job;
+	}
+
+	future<HttpResponse> HttpEngine::submit(const HttpRequest &request)
+	{
+		uint64_t one = 1;
+		Job *job = new Job();
+		future<HttpResponse> result = job->promise.get_future();
+
+		job->request = request;
+		{
+			lock_guard<mutex> lk(queueLock);
+			if (running)
+			{
+				queue.push_back(job);
+				if (write(evfd, &one, sizeof(one)) < 0)
+					*logs << "HttpEngine: unable to wake event loop" << endl;
+				return result;
+			}
+		}
+
+		// No loop (yet), so block this thread instead.
+		if (stopped)
+			job->response.result = CURLE_ABORTED_BY_CALLBACK;
+		else
+			client.perform(job->request, job->response);
+		job->promise.set_value(std::move(job->response));
+		delete job;
+		return result;
+	}
+
+	int HttpEngine::perform(const HttpRequest &request, HttpResponse &response)
+	{
+		response = submit(request).get();
+
+		if (response.ok())
+			return 0;
+		return response.code ? (int) response.code : -1;
+	}
+
+	vector<HttpResponse> HttpEngine::performAll(const vector<HttpRequest> &requests)
+	{
+		vector<future<HttpResponse> > futures;
+		vector<HttpResponse> responses;
+
+		for (vector<HttpRequest>::const_iterator it = requests.begin(); it != requests.end(); ++it)
+			futures.push_back(submit(*it));
+
+		for (vector<future<HttpResponse> >::iterator it = futures.begin(); it != futures.end(); ++it)
+			responses.push_back(it->get());
+
+		return responses;
+	}
+
+	// curl tells us which sockets to watch and for what.
+	int HttpEngine::socketCallback(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp)
+	{
+		HttpEngine *engine = (HttpEngine*) userp;
+		struct epoll_event ev;
+
+		if (what == CURL_POLL_REMOVE)
+		{
+			epoll_ctl(engine->epfd, EPOLL_CTL_DEL, s, NULL);
+			return 0;
+		}
+
+		ev.events = 0;
+		ev.data.fd = s;
+		if (what & CURL_POLL_IN)
+			ev.events |= EPOLLIN;
+		if (what & CURL_POLL_OUT)
+			ev.events |= EPOLLOUT;
+
+		// socketp marks sockets already registered with epoll.
+		if (socketp)
+			epoll_ctl(engine->epfd, EPOLL_CTL_MOD, s, &ev);
+		else
+		{
+			epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev);
+			curl_multi_assign(engine->multi, s, engine);
+		}
+		return 0;
+	}
+
+	int HttpEngine::timerCallback(CURLM *multi, long timeout_ms, void *userp)
+	{
+		HttpEngine *engine = (HttpEngine*) userp;
+
+		engine->timerSet = timeout_ms >= 0;
+		if (engine->timerSet)
+			engine->deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+		return 0;
+	}
+
+	// Move newly submitted jobs into the multi handle.
+	void HttpEngine::drain()
+	{
+		deque<Job*> jobs;
+		uint64_t count;
+
+		if (read(evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			*logs << "HttpEngine: eventfd read failed" << endl;
+
+		{
+			lock_guard<mutex> lk(queueLock);
+			jobs.swap(queue);
+		}
+
+		for (deque<Job*>::iterator it = jobs.begin(); it != jobs.end(); ++it)
+		{
+			Job *job = *it;
+			if (!(job->curl = client.acquire()))
+			{
+				abort(job);
+				continue;
+			}
+
+			client.setup(*job);
+			active.insert(job);
+			curl_multi_add_handle(multi, job->curl);
+		}
+	}
+
+	// Hand finished transfers back to their waiters.
+	void HttpEngine::complete()
+	{
+		CURLMsg *msg;
+		int left;
+
+		while ((msg = curl_multi_info_read(multi, &left)))
+		{
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			HttpTransfer *t;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &t);
+			Job *job = static_cast<Job*>(t);
+
+			job->response.result = msg->data.result;
+			curl_multi_remove_handle(multi, job->curl);
+			client.finish(*job);
+			active.erase(job);
+
+			job->promise.set_value(std::move(job->response));
+			delete job;
+		}
+	}
+
+	void HttpEngine::loop()
+	{
+		struct epoll_event events[64];
+		int still;
+
+		while (running)
+		{
+			int wait = 1000;
+			if (timerSet)
+			{
+				long ms = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+				wait = ms < 0 ? 0 : (ms < wait ? (int) ms : wait);
+			}
+
+			int n = epoll_wait(epfd, events, 64, wait);
+			for (int i = 0; i < n; ++i)
+			{
+				if (events[i].data.fd == evfd)
+				{
+					drain();
+					continue;
+				}
+
+				int flags = 0;
+				if (events[i].events & EPOLLIN)
+					flags |= CURL_CSELECT_IN;
+				if (events[i].events & EPOLLOUT)
+					flags |= CURL_CSELECT_OUT;
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					flags |= CURL_CSELECT_ERR;
+				curl_multi_socket_action(multi, events[i].data.fd, flags, &still);
+			}
+
+			if (timerSet && chrono::steady_clock::now() >= deadline)
+			{
+				timerSet = false;
+				curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still);
+			}
+
+			complete();
+		}
+	}
+}
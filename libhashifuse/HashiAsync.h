@@ -0,0 +1,81 @@
+/****************************************************************************
+**
+** libhashifuse - asynchronous request engine.
+**
+** Authored by John Boero
+**
+** One event loop thread drives a curl_multi handle through epoll socket
+** callbacks.  FUSE callbacks submit requests and wait on futures, so a
+** single process can keep hundreds of REST calls in flight without a
+** thread per request.  Easy handles come from (and go back to) the
+** HttpClient pool so connections are still reused.
+****************************************************************************/
+
+#ifndef HASHI_ASYNC
+#define HASHI_ASYNC
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <set>
+#include <thread>
+#include "HashiCURL.h"
+
+namespace hashifuse
+{
+	class HttpEngine
+	{
+	public:
+		HttpEngine(HttpClient &client);
+		~HttpEngine();
+
+		// Start from the FUSE init callback: fuse_main forks before that
+		// and threads created earlier would not survive daemonizing.
+		bool start(long maxConnections = 64);
+		void stop();
+
+		// Queue a request.  Runs inline if the loop hasn't started yet,
+		// and fails straight away once stop() has been called.
+		std::future<HttpResponse> submit(const HttpRequest &request);
+
+		// Submit and wait.  Same return convention as HttpClient::perform.
+		int perform(const HttpRequest &request, HttpResponse &response);
+
+		// Fan out a batch concurrently.  Responses come back in request order.
+		std::vector<HttpResponse> performAll(const std::vector<HttpRequest> &requests);
+
+	private:
+		HttpEngine(const HttpEngine&);
+		HttpEngine &operator=(const HttpEngine&);
+
+		struct Job : HttpTransfer
+		{
+			std::promise<HttpResponse> promise;
+		};
+
+		static int socketCallback(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp);
+		static int timerCallback(CURLM *multi, long timeout_ms, void *userp);
+
+		void loop();
+		void drain();
+		void complete();
+		void abort(Job *job);
+
+		HttpClient &client;
+		CURLM *multi;
+		int epfd, evfd;
+
+		// Only touched from the loop thread.
+		bool timerSet;
+		std::chrono::steady_clock::time_point deadline;
+		std::set<Job*> active;
+
+		std::thread thread;
+		std::atomic<bool> running, stopped;
+		std::mutex queueLock;
+		std::deque<Job*> queue;
+	};
+}
+
+#endif
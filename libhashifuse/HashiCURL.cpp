@@ -0,0 +1,238 @@
+/****************************************************************************
+**
+** libhashifuse - shared HTTP layer for the HashiFUSE clients.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include <algorithm>
+#include <iostream>
+#include "HashiCURL.h"
+#include "StdColors.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	// Keep a few idle handles around; more than this are closed on release.
+	static const size_t maxPool = 64;
+
+	// CURL callbacks
+	namespace
+	{
+		size_t write_callback(const char* in, size_t size, size_t num, void* out)
+		{
+			HttpTransfer *t = (HttpTransfer*) out;
+
+			// Returning short makes curl fail the transfer with CURLE_WRITE_ERROR.
+			if (t->request.sink)
+				return t->request.sink(in, size * num) ? size * num : 0;
+			if (t->request.maxBody && t->response.body.size() + size * num > t->request.maxBody)
+				return 0;
+			t->response.body.append(in, size * num);
+
+			#if DEBUG
+			*logs << GREEN << string(in, size * num) << RESET << endl;
+			#endif
+			return size * num;
+		}
+
+		size_t header_callback(const char* in, size_t size, size_t num, void* out)
+		{
+			string line(in, size * num);
+			size_t colon = line.find(':');
+
+			if (colon != string::npos)
+			{
+				string name = line.substr(0, colon), value = line.substr(colon + 1);
+				transform(name.begin(), name.end(), name.begin(), ::tolower);
+				value.erase(0, value.find_first_not_of(" \t"));
+				value.erase(value.find_last_not_of(" \t\r\n") + 1);
+				((HttpTransfer*) out)->response.headers[name] = value;
+			}
+			return size * num;
+		}
+	}
+
+	string HttpResponse::header(const string &name) const
+	{
+		string lower(name);
+		transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+		map<string, string>::const_iterator it = headers.find(lower);
+		return it == headers.end() ? "" : it->second;
+	}
+
+	HttpClient::HttpClient() : timeout(5), headers(NULL), share(NULL)
+	{
+	}
+
+	HttpClient::~HttpClient()
+	{
+		close();
+	}
+
+	// Must run after curl_global_init, so not from a global constructor.
+	void HttpClient::open()
+	{
+		share = curl_share_init();
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+		curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		#if LIBCURL_VERSION_NUM >= 0x073900
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		#endif
+	}
+
+	// Call before curl_global_cleanup.
+	void HttpClient::close()
+	{
+		lock_guard<mutex> lk(poolLock);
+		for (vector<CURL*>::iterator it = pool.begin(); it != pool.end(); ++it)
+			curl_easy_cleanup(*it);
+		pool.clear();
+
+		if (share)
+			curl_share_cleanup(share);
+		share = NULL;
+
+		curl_slist_free_all(headers);
+		headers = NULL;
+	}
+
+	void HttpClient::lockShare(CURL *curl, curl_lock_data data, curl_lock_access access, void *ptr)
+	{
+		((HttpClient*) ptr)->shareLocks[data].lock();
+	}
+
+	void HttpClient::unlockShare(CURL *curl, curl_lock_data data, void *ptr)
+	{
+		((HttpClient*) ptr)->shareLocks[data].unlock();
+	}
+
+	void HttpClient::configure(const string &base, const vector<string> &headers, long timeout)
+	{
+		if (!share)
+			open();
+
+		this->base = base;
+		this->timeout = timeout;
+
+		curl_slist_free_all(this->headers);
+		this->headers = NULL;
+		for (vector<string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+			this->headers = curl_slist_append(this->headers, it->c_str());
+	}
+
+	CURL *HttpClient::acquire()
+	{
+		{
+			lock_guard<mutex> lk(poolLock);
+			if (!pool.empty())
+			{
+				CURL *curl = pool.back();
+				pool.pop_back();
+				return curl;
+			}
+		}
+		return curl_easy_init();
+	}
+
+	void HttpClient::release(CURL *curl)
+	{
+		// Reset drops our options but keeps the handle's live connections.
+		curl_easy_reset(curl);
+
+		{
+			lock_guard<mutex> lk(poolLock);
+			if (pool.size() < maxPool)
+			{
+				pool.push_back(curl);
+				return;
+			}
+		}
+		curl_easy_cleanup(curl);
+	}
+
+	void HttpClient::setup(HttpTransfer &t)
+	{
+		CURL *curl = t.curl;
+		const HttpRequest &req = t.request;
+
+		t.url = req.url.compare(0, 4, "http") ? base + req.url : req.url;
+
+		#if DEBUG
+		*logs << CYAN << req.method << ' ' << t.url << RESET << endl;
+		#endif
+
+		// Only copy the common header list when this request adds its own.
+		if (!req.headers.empty())
+		{
+			for (struct curl_slist *h = headers; h; h = h->next)
+				t.headers = curl_slist_append(t.headers, h->data);
+			for (vector<string>::const_iterator it = req.headers.begin(); it != req.headers.end(); ++it)
+				t.headers = curl_slist_append(t.headers, it->c_str());
+		}
+
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(curl, CURLOPT_URL, t.url.c_str());
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req.method.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t.headers ? t.headers : headers);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, req.timeout < 0 ? 0L : (req.timeout ? req.timeout : timeout));
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, req.idleTimeout ? 1L : 0L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, req.idleTimeout);
+		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &t);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, &t);
+
+		if (!caInfo.empty())
+			curl_easy_setopt(curl, CURLOPT_CAINFO, caInfo.c_str());
+		if (!sslCert.empty())
+			curl_easy_setopt(curl, CURLOPT_SSLCERT, sslCert.c_str());
+
+		// Binary safe body.  The request outlives the transfer so no copy is needed.
+		if (!req.body.empty())
+		{
+			#if DEBUG
+			*logs << YELLOW << req.body << RESET << endl;
+			#endif
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) req.body.size());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req.body.data());
+		}
+	}
+
+	void HttpClient::finish(HttpTransfer &t)
+	{
+		curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.response.code);
+		curl_slist_free_all(t.headers);
+		t.headers = NULL;
+
+		release(t.curl);
+		t.curl = NULL;
+	}
+
+	int HttpClient::perform(const HttpRequest &request, HttpResponse &response)
+	{
+		HttpTransfer t;
+		t.request = request;
+
+		if (!(t.curl = acquire()))
+			return -1;
+
+		setup(t);
+		t.response.result = curl_easy_perform(t.curl);
+		finish(t);
+
+		swap(response, t.response);
+		if (response.ok())
+			return 0;
+		return response.code ? (int) response.code : -1;
+	}
+}
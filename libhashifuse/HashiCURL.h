@@ -0,0 +1,119 @@
+/****************************************************************************
+**
+** libhashifuse - shared HTTP layer for the HashiFUSE clients.
+**
+** Authored by John Boero
+** Build instructions: make (produces libhashifuse.a)
+**
+** Every FS used to curl_easy_init/cleanup per request under one global mutex.
+** HttpClient instead keeps a pool of easy handles (live connections survive
+** between requests) and a curl_share for DNS, TLS sessions and connections,
+** so FUSE worker threads issue requests concurrently without a global lock.
+****************************************************************************/
+
+#ifndef HASHI_CURL
+#define HASHI_CURL
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <ostream>
+#include <curl/curl.h>
+
+// Each FS owns its log stream (CONSULFS_LOG, NOMADFS_LOG, etc.)
+extern std::ostream *logs;
+
+namespace hashifuse
+{
+	// One REST call.  url is relative to HttpClient::base unless it starts with "http".
+	struct HttpRequest
+	{
+		std::string url;
+		std::string method;
+		std::string body;
+		std::vector<std::string> headers;	// Extra headers for this request only.
+		long timeout;						// Seconds; 0 uses the client default, -1 never times out.
+		long idleTimeout;					// Seconds without a byte before giving up (0 = off).  For streams.
+		size_t maxBody;						// Abort once the response grows past this (0 = no limit).
+
+		// When set the body is handed over here as it arrives instead of
+		// collecting in HttpResponse::body.  Return false to abort the transfer.
+		// Async requests call it on the engine thread.
+		std::function<bool(const char *data, size_t len)> sink;
+
+		HttpRequest(const std::string &u = "", const std::string &m = "GET", const std::string &b = "")
+			: url(u), method(m), body(b), timeout(0), idleTimeout(0), maxBody(0) {}
+	};
+
+	struct HttpResponse
+	{
+		long code;							// HTTP status, 0 if we never got one.
+		CURLcode result;
+		std::string body;
+		std::map<std::string, std::string> headers;	// Lower case names.
+
+		HttpResponse() : code(0), result(CURLE_OK) {}
+		bool ok() const { return result == CURLE_OK && code >= 200 && code < 300; }
+		std::string header(const std::string &name) const;
+	};
+
+	// Per-request state owned by an easy handle while it is in flight.
+	struct HttpTransfer
+	{
+		HttpRequest request;
+		HttpResponse response;
+		std::string url;
+		struct curl_slist *headers;	// NULL when the client slist is shared as-is.
+		CURL *curl;
+
+		HttpTransfer() : headers(NULL), curl(NULL) {}
+	};
+
+	class HttpClient
+	{
+	public:
+		HttpClient();
+		~HttpClient();
+
+		// Settings are read once at init rather than getenv() per request.
+		// Call after curl_global_init; close() before curl_global_cleanup.
+		void configure(const std::string &base, const std::vector<std::string> &headers, long timeout = 5);
+		void setCA(const std::string &caInfo)		{ this->caInfo = caInfo; }
+		void setClientCert(const std::string &cert)	{ sslCert = cert; }
+		void close();
+
+		// Blocking request.  Returns 0 on 2xx, else the HTTP code (or -1 with no response).
+		int perform(const HttpRequest &request, HttpResponse &response);
+
+		// Used by the async engine to share handle setup and pooling.
+		CURL *acquire();
+		void release(CURL *curl);
+		void setup(HttpTransfer &transfer);
+		void finish(HttpTransfer &transfer);
+
+		const std::string &getBase() const	{ return base; }
+
+	private:
+		HttpClient(const HttpClient&);
+		HttpClient &operator=(const HttpClient&);
+		void open();
+
+		static void lockShare(CURL *curl, curl_lock_data data, curl_lock_access access, void *ptr);
+		static void unlockShare(CURL *curl, curl_lock_data data, void *ptr);
+
+		std::string base, caInfo, sslCert;
+		long timeout;
+		struct curl_slist *headers;
+
+		CURLSH *share;
+		std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+
+		// Idle easy handles keep their connections open for the next request.
+		std::mutex poolLock;
+		std::vector<CURL*> pool;
+	};
+}
+
+#endif
@@ -0,0 +1,134 @@
+/****************************************************************************
+**
+** libhashifuse - bounded content cache.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include <string.h>
+#include "HashiCache.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	ContentCache::ContentCache(size_t maxBytes, long ttlMs, bool zeroize)
+		: maxBytes(maxBytes), used(0), ttlMs(ttlMs), zeroize(zeroize)
+	{
+	}
+
+	ContentCache::~ContentCache()
+	{
+		clear();
+	}
+
+	void ContentCache::configure(size_t maxBytes, long ttlMs, bool zeroize)
+	{
+		clear();
+
+		lock_guard<mutex> lk(lock);
+		this->maxBytes = maxBytes;
+		this->ttlMs = ttlMs;
+		this->zeroize = zeroize;
+	}
+
+	void ContentCache::put(const string &key, const string &value, uint64_t version, long ttlMs)
+	{
+		lock_guard<mutex> lk(lock);
+		Entries::iterator it = entries.find(key);
+
+		if (it != entries.end())
+			drop(it);
+
+		// Don't let one huge value flush everything else.
+		if (key.size() + value.size() > maxBytes / 4)
+			return;
+
+		if (ttlMs < 0)
+			ttlMs = this->ttlMs;
+
+		Entry &e = entries[key];
+		e.value = value;
+		e.version = version;
+		e.expires = ttlMs ? Clock::now() + chrono::milliseconds(ttlMs) : Clock::time_point();
+		recent.push_front(key);
+		e.lru = recent.begin();
+		used += key.size() + value.size();
+
+		while (used > maxBytes && !recent.empty())
+			drop(entries.find(recent.back()));
+	}
+
+	bool ContentCache::get(const string &key, string &value, uint64_t *version)
+	{
+		lock_guard<mutex> lk(lock);
+		Entries::iterator it = entries.find(key);
+
+		if (it == entries.end())
+			return false;
+
+		if (it->second.expires != Clock::time_point() && Clock::now() >= it->second.expires)
+		{
+			drop(it);
+			return false;
+		}
+
+		recent.splice(recent.begin(), recent, it->second.lru);
+		value = it->second.value;
+		if (version)
+			*version = it->second.version;
+		return true;
+	}
+
+	void ContentCache::erase(const string &key)
+	{
+		lock_guard<mutex> lk(lock);
+		Entries::iterator it = entries.find(key);
+
+		if (it != entries.end())
+			drop(it);
+	}
+
+	void ContentCache::erasePrefix(const string &prefix)
+	{
+		lock_guard<mutex> lk(lock);
+		Entries::iterator it = entries.lower_bound(prefix);
+
+		while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+			drop(it++);
+	}
+
+	void ContentCache::clear()
+	{
+		lock_guard<mutex> lk(lock);
+
+		while (!entries.empty())
+			drop(entries.begin());
+	}
+
+	size_t ContentCache::bytes()
+	{
+		lock_guard<mutex> lk(lock);
+		return used;
+	}
+
+	// Caller holds the lock.
+	void ContentCache::drop(Entries::iterator it)
+	{
+		used -= it->first.size() + it->second.value.size();
+		recent.erase(it->second.lru);
+		wipe(it->second.value);
+		entries.erase(it);
+	}
+
+	void ContentCache::wipe(string &value)
+	{
+		if (!zeroize || value.empty())
+			return;
+
+		// volatile so the stores aren't optimised away ahead of the free.
+		volatile char *p = &value[0];
+		for (size_t i = 0; i < value.size(); ++i)
+			p[i] = 0;
+	}
+}
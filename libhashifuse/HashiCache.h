@@ -0,0 +1,73 @@
+/****************************************************************************
+**
+** libhashifuse - bounded content cache.
+**
+** Authored by John Boero
+**
+** LRU of fetched values capped by total bytes, with optional per-entry
+** expiry.  Each entry carries a caller defined version (Consul ModifyIndex,
+** Vault KV version) so callers can check it against fresher metadata.
+** With zeroize set, values are wiped before their memory is released,
+** for caches that hold secrets.
+****************************************************************************/
+
+#ifndef HASHI_CACHE
+#define HASHI_CACHE
+
+#include <string>
+#include <list>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <stdint.h>
+
+namespace hashifuse
+{
+	class ContentCache
+	{
+	public:
+		ContentCache(size_t maxBytes = 64 << 20, long ttlMs = 0, bool zeroize = false);
+		~ContentCache();
+
+		void configure(size_t maxBytes, long ttlMs, bool zeroize = false);
+
+		// ttlMs < 0 uses the cache default, 0 never expires.
+		void put(const std::string &key, const std::string &value, uint64_t version = 0, long ttlMs = -1);
+		bool get(const std::string &key, std::string &value, uint64_t *version = NULL);
+
+		void erase(const std::string &key);
+		void erasePrefix(const std::string &prefix);
+		void clear();
+
+		size_t bytes();
+		bool enabled() const	{ return maxBytes > 0; }
+
+	private:
+		ContentCache(const ContentCache&);
+		ContentCache &operator=(const ContentCache&);
+
+		typedef std::chrono::steady_clock Clock;
+		typedef std::list<std::string> Recent;
+
+		struct Entry
+		{
+			std::string value;
+			uint64_t version;
+			Clock::time_point expires;	// time_point() for never.
+			Recent::iterator lru;
+		};
+		typedef std::map<std::string, Entry> Entries;
+
+		void drop(Entries::iterator it);
+		void wipe(std::string &value);
+
+		std::mutex lock;
+		size_t maxBytes, used;
+		long ttlMs;
+		bool zeroize;
+		Entries entries;
+		Recent recent;					// Most recently used first.
+	};
+}
+
+#endif
@@ -0,0 +1,64 @@
+/****************************************************************************
+**
+** libhashifuse - per-open file state kept in fuse_file_info::fh.
+**
+** Authored by John Boero
+**
+** Content is fetched once in open() and freed in release(), so a cat costs
+** one request and concurrent readers never share a buffer.
+** Include after <fuse.h> (FUSE_USE_VERSION must already be defined).
+****************************************************************************/
+
+#ifndef HASHI_FILE
+#define HASHI_FILE
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fuse.h>
+
+namespace hashifuse
+{
+	// FS specific handles derive from this and add what they need.
+	struct FileHandle
+	{
+		std::string data;
+
+		virtual ~FileHandle() {}
+	};
+
+	inline FileHandle *getHandle(struct fuse_file_info *fi)
+	{
+		return fi ? (FileHandle*) (uintptr_t) fi->fh : NULL;
+	}
+
+	inline void setHandle(struct fuse_file_info *fi, FileHandle *handle)
+	{
+		fi->fh = (uint64_t) (uintptr_t) handle;
+	}
+
+	inline void freeHandle(struct fuse_file_info *fi)
+	{
+		delete getHandle(fi);
+		fi->fh = 0;
+	}
+
+	// Binary safe copy of [offset, offset + size) out of a snapshot.
+	inline int readBuffer(const std::string &data, char *buf, size_t size, off_t offset)
+	{
+		if (offset < 0)
+			return -EINVAL;
+		if ((size_t) offset >= data.size())
+			return 0;
+
+		size_t len = data.size() - offset;
+		if (len > size)
+			len = size;
+
+		memcpy(buf, data.data() + offset, len);
+		return len;
+	}
+}
+
+#endif
@@ -0,0 +1,133 @@
+/****************************************************************************
+**
+** libhashifuse - incremental JSON array scanner.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include "HashiJson.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	static void appendUtf8(string &out, unsigned cp)
+	{
+		if (cp < 0x80)
+			out += (char) cp;
+		else if (cp < 0x800)
+		{
+			out += (char) (0xc0 | cp >> 6);
+			out += (char) (0x80 | (cp & 0x3f));
+		}
+		else
+		{
+			out += (char) (0xe0 | cp >> 12);
+			out += (char) (0x80 | (cp >> 6 & 0x3f));
+			out += (char) (0x80 | (cp & 0x3f));
+		}
+	}
+
+	JsonArrayScanner::JsonArrayScanner(const vector<string> &path, Callback callback)
+		: path(path), callback(callback), inString(false), escape(false), hexDigits(0), codepoint(0), found(0)
+	{
+	}
+
+	// Structure only: numbers, true/false/null fall through as ignored bytes.
+	void JsonArrayScanner::feed(const char *data, size_t len)
+	{
+		for (size_t i = 0; i < len; ++i)
+		{
+			const char c = data[i];
+
+			if (inString)
+			{
+				if (hexDigits)
+				{
+					codepoint = codepoint << 4 | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+					if (!--hexDigits)
+						appendUtf8(token, codepoint);
+				}
+				else if (escape)
+				{
+					escape = false;
+					switch (c)
+					{
+					case 'n': token += '\n'; break;
+					case 't': token += '\t'; break;
+					case 'r': token += '\r'; break;
+					case 'b': token += '\b'; break;
+					case 'f': token += '\f'; break;
+					case 'u': hexDigits = 4; codepoint = 0; break;
+					default: token += c;
+					}
+				}
+				else if (c == '\\')
+					escape = true;
+				else if (c == '"')
+					endString();
+				else
+				{
+					// Copy the plain run up to the next quote or escape in one go.
+					size_t j = i;
+					while (j < len && data[j] != '"' && data[j] != '\\')
+						++j;
+					token.append(data + i, j - i);
+					i = j - 1;
+				}
+				continue;
+			}
+
+			switch (c)
+			{
+			case '"':
+				inString = true;
+				token.clear();
+				break;
+			case '{':
+			case '[':
+				stack.push_back(Level());
+				stack.back().object = c == '{';
+				stack.back().expectKey = c == '{';
+				break;
+			case '}':
+			case ']':
+				if (!stack.empty())
+					stack.pop_back();
+				break;
+			case ',':
+				if (!stack.empty() && stack.back().object)
+					stack.back().expectKey = true;
+				break;
+			case ':':
+				if (!stack.empty() && stack.back().object)
+					stack.back().expectKey = false;
+				break;
+			}
+		}
+	}
+
+	void JsonArrayScanner::endString()
+	{
+		inString = false;
+
+		if (!stack.empty() && stack.back().object && stack.back().expectKey)
+			stack.back().key.swap(token);
+		else if (matches())
+		{
+			++found;
+			callback(token);
+		}
+	}
+
+	bool JsonArrayScanner::matches() const
+	{
+		if (stack.size() != path.size() + 1 || stack.back().object)
+			return false;
+
+		for (size_t i = 0; i < path.size(); ++i)
+			if (!stack[i].object || stack[i].key != path[i])
+				return false;
+		return true;
+	}
+}
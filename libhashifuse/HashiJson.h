@@ -0,0 +1,57 @@
+/****************************************************************************
+**
+** libhashifuse - incremental JSON array scanner.
+**
+** Authored by John Boero
+**
+** Picks the string elements of one array out of a JSON document as the
+** bytes arrive, so a LIST with hundreds of thousands of keys can go
+** straight to the filler without ever becoming a Json::Value.
+****************************************************************************/
+
+#ifndef HASHI_JSON
+#define HASHI_JSON
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace hashifuse
+{
+	class JsonArrayScanner
+	{
+	public:
+		typedef std::function<void(const std::string &value)> Callback;
+
+		// path names the members leading to the array: {"data", "keys"} for a Vault LIST.
+		JsonArrayScanner(const std::vector<std::string> &path, Callback callback);
+
+		// Feed the document in pieces of any size, e.g. from HttpRequest::sink.
+		void feed(const char *data, size_t len);
+
+		// Strings handed to the callback so far.
+		size_t count() const	{ return found; }
+
+	private:
+		struct Level
+		{
+			bool		object;
+			bool		expectKey;	// Next string in this object is a member name.
+			std::string	key;		// Member we're inside of.
+		};
+
+		void endString();
+		bool matches() const;
+
+		std::vector<std::string> path;
+		Callback callback;
+		std::vector<Level> stack;
+		std::string token;
+		bool inString, escape;
+		int hexDigits;				// Left to read of a \u escape.
+		unsigned codepoint;
+		size_t found;
+	};
+}
+
+#endif
@@ -0,0 +1,97 @@
+/****************************************************************************
+**
+** libhashifuse - minimal ustar writer.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include <string.h>
+#include "HashiTar.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	static const size_t block = 512;
+
+	// Zero padded octal and a NUL in len bytes.  Values that don't fit
+	// (files of 8GiB and up) use the GNU base-256 form tar and libarchive read.
+	static void octal(char *field, size_t len, unsigned long long value)
+	{
+		if (len - 1 < 22 && value >> (3 * (len - 1)))
+		{
+			field[0] = (char) 0x80;
+			for (size_t i = len - 1; i > 0; --i, value >>= 8)
+				field[i] = (char) (value & 0xff);
+			return;
+		}
+
+		field[len - 1] = '\0';
+		for (size_t i = len - 1; i > 0; --i, value >>= 3)
+			field[i - 1] = '0' + (value & 7);
+	}
+
+	static void header(string &out, const string &name, const string &prefix, size_t size, time_t mtime, mode_t mode, char type)
+	{
+		char h[block];
+		unsigned sum = 0;
+
+		memset(h, 0, sizeof(h));
+		memcpy(h, name.data(), min(name.size(), (size_t) 100));
+		octal(h + 100, 8, mode);
+		octal(h + 108, 8, 0);
+		octal(h + 116, 8, 0);
+		octal(h + 124, 12, size);
+		octal(h + 136, 12, mtime < 0 ? 0 : mtime);
+		h[156] = type;
+		memcpy(h + 257, "ustar", 6);
+		memcpy(h + 263, "00", 2);
+		memcpy(h + 345, prefix.data(), min(prefix.size(), (size_t) 155));
+
+		// Checksum is taken with its own field as spaces.
+		memset(h + 148, ' ', 8);
+		for (size_t i = 0; i < block; ++i)
+			sum += (unsigned char) h[i];
+		octal(h + 148, 7, sum);
+
+		out.append(h, block);
+	}
+
+	static void pad(string &out, size_t size)
+	{
+		if (size % block)
+			out.append(block - size % block, '\0');
+	}
+
+	void tarFile(string &out, const string &name, const string &content, time_t mtime, mode_t mode)
+	{
+		string prefix, base = name;
+
+		// ustar splits up to 255 chars at a slash: prefix (155) / name (100).
+		if (name.size() > 100)
+		{
+			size_t slash = name.rfind('/', 155);
+			if (slash != string::npos && name.size() - slash - 1 <= 100 && slash > 0)
+			{
+				prefix = name.substr(0, slash);
+				base = name.substr(slash + 1);
+			}
+			else
+			{
+				header(out, "././@LongLink", "", name.size() + 1, 0, 0644, 'L');
+				out.append(name.c_str(), name.size() + 1);
+				pad(out, name.size() + 1);
+				base = name.substr(0, 100);
+			}
+		}
+
+		header(out, base, prefix, content.size(), mtime, mode, '0');
+		out += content;
+		pad(out, content.size());
+	}
+
+	void tarEnd(string &out)
+	{
+		out.append(2 * block, '\0');
+	}
+}
@@ -0,0 +1,29 @@
+/****************************************************************************
+**
+** libhashifuse - minimal ustar writer.
+**
+** Authored by John Boero
+**
+** Appends archive entries to a string so an FS can stream a tar out of
+** a virtual file while it is still walking the tree that fills it.
+****************************************************************************/
+
+#ifndef HASHI_TAR
+#define HASHI_TAR
+
+#include <string>
+#include <time.h>
+#include <sys/types.h>
+
+namespace hashifuse
+{
+	// One regular file: header, content, padding to the 512 byte block.
+	// Names too long for ustar get a GNU long name entry first, and sizes
+	// of 8GiB and up a GNU base-256 size field.
+	void tarFile(std::string &out, const std::string &name, const std::string &content, time_t mtime, mode_t mode = 0600);
+
+	// The two zero blocks that end an archive.
+	void tarEnd(std::string &out);
+}
+
+#endif
@@ -0,0 +1,96 @@
+/****************************************************************************
+**
+** libhashifuse - small helpers shared by the FS clients.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#include <ctype.h>
+#include "HashiUtil.h"
+
+using namespace std;
+
+namespace hashifuse
+{
+	static const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	string base64Encode(const string &raw)
+	{
+		string out;
+		size_t i = 0;
+
+		out.reserve((raw.size() + 2) / 3 * 4);
+		for (; i + 2 < raw.size(); i += 3)
+		{
+			unsigned n = (unsigned char) raw[i] << 16 | (unsigned char) raw[i + 1] << 8 | (unsigned char) raw[i + 2];
+			out += b64chars[n >> 18 & 63];
+			out += b64chars[n >> 12 & 63];
+			out += b64chars[n >> 6 & 63];
+			out += b64chars[n & 63];
+		}
+
+		if (i < raw.size())
+		{
+			unsigned n = (unsigned char) raw[i] << 16;
+			if (i + 1 < raw.size())
+				n |= (unsigned char) raw[i + 1] << 8;
+
+			out += b64chars[n >> 18 & 63];
+			out += b64chars[n >> 12 & 63];
+			out += i + 1 < raw.size() ? b64chars[n >> 6 & 63] : '=';
+			out += '=';
+		}
+		return out;
+	}
+
+	// Skips anything outside the alphabet (newlines, padding).
+	string base64Decode(const string &b64)
+	{
+		string out;
+		unsigned n = 0;
+		int bits = 0;
+
+		out.reserve(b64.size() / 4 * 3);
+		for (string::const_iterator it = b64.begin(); it != b64.end(); ++it)
+		{
+			int v;
+			char c = *it;
+
+			if (c >= 'A' && c <= 'Z')		v = c - 'A';
+			else if (c >= 'a' && c <= 'z')	v = c - 'a' + 26;
+			else if (c >= '0' && c <= '9')	v = c - '0' + 52;
+			else if (c == '+' || c == '-')	v = 62;
+			else if (c == '/' || c == '_')	v = 63;
+			else continue;
+
+			n = n << 6 | v;
+			if ((bits += 6) >= 8)
+			{
+				bits -= 8;
+				out += (char) (n >> bits & 0xFF);
+			}
+		}
+		return out;
+	}
+
+	string urlEncode(const string &raw)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		string out;
+
+		for (string::const_iterator it = raw.begin(); it != raw.end(); ++it)
+		{
+			const unsigned char c = *it;
+
+			if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+				out += c;
+			else
+			{
+				out += '%';
+				out += hex[c >> 4];
+				out += hex[c & 15];
+			}
+		}
+		return out;
+	}
+}
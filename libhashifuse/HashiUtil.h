@@ -0,0 +1,23 @@
+/****************************************************************************
+**
+** libhashifuse - small helpers shared by the FS clients.
+**
+** Authored by John Boero
+****************************************************************************/
+
+#ifndef HASHI_UTIL
+#define HASHI_UTIL
+
+#include <string>
+
+namespace hashifuse
+{
+	// Consul KV values, Vault transit, etc. all travel base64 encoded.
+	std::string base64Encode(const std::string &raw);
+	std::string base64Decode(const std::string &b64);
+
+	// Percent-encode everything but RFC 3986 unreserved characters, for query values.
+	std::string urlEncode(const std::string &raw);
+}
+
+#endif